@@ -57,6 +57,9 @@ either expressed or implied, of the FreeBSD Project.
 
 extern zarray_t *apriltag_quad_gradient(apriltag_detector_t *td, image_u8_t *im);
 extern zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im);
+extern zarray_t *apriltag_quad_thresh_small(apriltag_detector_t *td, image_u8_t *im,
+                                            int small_size, zarray_t *small_boxes);
+extern void apriltag_quad_cache_destroy(struct apriltag_quad_cache *qc);
 
 struct quick_decode_entry
 {
@@ -323,6 +326,16 @@ apriltag_detector_t *apriltag_detector_create()
     td->qtp.critical_rad = 10 * M_PI / 180;
     td->qtp.deglitch = 0;
     td->qtp.min_white_black_diff = 15;
+    td->qtp.thresh_method = APRILTAG_THRESH_TILE;
+    td->qtp.mean_radius = 12;
+    td->qtp.mean_offset = 5;
+    td->qtp.skip_flat_tiles = 1;
+
+    td->pyramid_levels = 1;
+
+    td->incremental = 0;
+    td->refresh_interval = 30;
+    td->change_threshold = 3;
 
     td->tag_families = zarray_create(sizeof(apriltag_family_t*));
 
@@ -345,6 +358,7 @@ void apriltag_detector_destroy(apriltag_detector_t *td)
 {
     timeprofile_destroy(td->tp);
     workerpool_destroy(td->wp);
+    apriltag_quad_cache_destroy(td->quad_cache);
 
     apriltag_detector_clear_families(td);
 
@@ -359,7 +373,7 @@ struct quad_decode_task
     apriltag_detector_t *td;
 
     image_u8_t *im;
-    zarray_t *detections;
+    zarray_t *detections; // this task's output; concatenated in task order.
 
     image_u8_t *im_gray_samples;
     image_u8_t *im_decision;
@@ -739,16 +753,39 @@ double optimize_quad_generic(apriltag_family_t *family, image_u8_t *im, struct q
     return best_score;
 }
 
-static void quad_decode_task(void *_u)
+static double quad_area(struct quad *quad)
 {
-    struct quad_decode_task *task = (struct quad_decode_task*) _u;
-    apriltag_detector_t *td = task->td;
-    image_u8_t *im = task->im;
+    double area = 0;
+    for (int i = 0; i < 4; i++) {
+        int j = (i + 1) & 3;
+        area += quad->p[i][0]*quad->p[j][1] - quad->p[j][0]*quad->p[i][1];
+    }
 
-    for (int quadidx = task->i0; quadidx < task->i1; quadidx++) {
-        struct quad *quad_original;
-        zarray_get_volatile(task->quads, quadidx, &quad_original);
+    return fabs(area) / 2;
+}
+
+// A rough estimate of the work quad_decode_task does for a quad, in
+// pixels sampled. Decoding samples a fixed number of bits per family,
+// but refine_pose's quad_goodness visits every pixel of the tag, so
+// large quads dominate when it's on.
+static double quad_decode_cost(apriltag_detector_t *td, struct quad *quad)
+{
+    // XXX Tunable: sampling the bits and the border, relative to one
+    // pixel of quad_goodness.
+    double cost = 256;
+
+    if (td->refine_pose)
+        cost += quad_area(quad);
+
+    return cost * zarray_size(td->tag_families);
+}
 
+// Decode one quad against every family, adding any detections to
+// detections.
+static void quad_decode_one(apriltag_detector_t *td, image_u8_t *im,
+                            struct quad *quad_original, zarray_t *detections)
+{
+    if (1) {
         // make sure the homographies are computed...
         quad_update_homographies(quad_original);
 
@@ -830,9 +867,7 @@ static void quad_decode_task(void *_u)
                     det->p[i][1] = p[1];
                 }
 
-                pthread_mutex_lock(&td->mutex);
-                zarray_add(task->detections, &det);
-                pthread_mutex_unlock(&td->mutex);
+                zarray_add(detections, &det);
             }
 
             quad_destroy(quad);
@@ -840,6 +875,207 @@ static void quad_decode_task(void *_u)
     }
 }
 
+static void quad_decode_task(void *_u)
+{
+    struct quad_decode_task *task = (struct quad_decode_task*) _u;
+
+    for (int quadidx = task->i0; quadidx < task->i1; quadidx++) {
+        struct quad *quad;
+        zarray_get_volatile(task->quads, quadidx, &quad);
+
+        quad_decode_one(task->td, task->im, quad, task->detections);
+    }
+}
+
+// Decoding in priority order, shared by the tasks: each takes the
+// next quad in order until a limit is reached.
+struct quad_decode_budget
+{
+    apriltag_detector_t *td;
+    image_u8_t *im;
+    zarray_t *quads;
+
+    int *order;          // indices into quads, best first
+    int norder;          // (at most max_decode_quads)
+    zarray_t **results;  // detections for order[k], NULL if not decoded
+
+    int next;            // position in order to decode next
+    int64_t deadline_utime;
+
+    int *found;          // per expected id
+    int nfound;
+    int stop;
+};
+
+struct quad_priority
+{
+    int idx;
+    double priority;
+};
+
+static int quad_priority_compare(const void *_a, const void *_b)
+{
+    const struct quad_priority *a = _a, *b = _b;
+
+    if (a->priority != b->priority)
+        return a->priority > b->priority ? -1 : 1;
+    return a->idx - b->idx;
+}
+
+// How much a quad looks like a tag, for deciding what to decode first:
+// the contrast across its edges (a tag's border is dark inside and
+// light outside), times its size up to a point, discounted by how
+// poorly lines fit its edges. A few dozen pixel reads.
+static double quad_decode_priority(image_u8_t *im, struct quad *quad)
+{
+    double cx = 0, cy = 0;
+    for (int i = 0; i < 4; i++) {
+        cx += quad->p[i][0] / 4;
+        cy += quad->p[i][1] / 4;
+    }
+
+    double contrast = 0;
+    int nsamples = 0;
+
+    for (int i = 0; i < 4; i++) {
+        int j = (i + 1) & 3;
+        double dx = quad->p[j][0] - quad->p[i][0];
+        double dy = quad->p[j][1] - quad->p[i][1];
+        double len = sqrt(dx*dx + dy*dy);
+        if (len < 1)
+            continue;
+
+        // outward normal, and a step that lands inside a black border
+        // (a tenth of the side for 36h11) and as far outside.
+        double nx = dy / len, ny = -dx / len;
+        if ((quad->p[i][0] - cx)*nx + (quad->p[i][1] - cy)*ny < 0) {
+            nx = -nx;
+            ny = -ny;
+        }
+        double step = fmax(1, len / 20);
+
+        for (int k = 1; k <= 4; k++) {
+            double x = quad->p[i][0] + dx * k / 5;
+            double y = quad->p[i][1] + dy * k / 5;
+
+            int xin = x - step*nx, yin = y - step*ny;
+            int xout = x + step*nx, yout = y + step*ny;
+
+            if (xin < 0 || yin < 0 || xin >= im->width || yin >= im->height ||
+                xout < 0 || yout < 0 || xout >= im->width || yout >= im->height)
+                continue;
+
+            contrast += im->buf[yout*im->stride + xout] - im->buf[yin*im->stride + xin];
+            nsamples++;
+        }
+    }
+
+    if (nsamples == 0)
+        return 0;
+
+    // XXX Tunable: past about 50 pixels across, a bigger quad is no
+    // more likely to be a tag.
+    return fmax(0, contrast / nsamples) * fmin(sqrt(quad_area(quad)), 50) / (1 + quad->line_mse);
+}
+
+static void quad_decode_budget_task(void *_u)
+{
+    struct quad_decode_budget *b = (struct quad_decode_budget*) _u;
+    apriltag_detector_t *td = b->td;
+
+    while (!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+        int k = __atomic_fetch_add(&b->next, 1, __ATOMIC_ACQ_REL);
+        if (k >= b->norder)
+            break;
+
+        // always decode the best quad.
+        if (k > 0 && b->deadline_utime && utime_now() > b->deadline_utime) {
+            __atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+            break;
+        }
+
+        struct quad *quad;
+        zarray_get_volatile(b->quads, b->order[k], &quad);
+
+        zarray_t *dets = zarray_create(sizeof(apriltag_detection_t*));
+        quad_decode_one(td, b->im, quad, dets);
+        b->results[k] = dets;
+
+        for (int i = 0; i < zarray_size(dets); i++) {
+            apriltag_detection_t *det;
+            zarray_get(dets, i, &det);
+
+            for (int e = 0; e < td->nexpected_ids; e++) {
+                if (det->id != td->expected_ids[e] ||
+                    __atomic_exchange_n(&b->found[e], 1, __ATOMIC_ACQ_REL))
+                    continue;
+
+                if (__atomic_add_fetch(&b->nfound, 1, __ATOMIC_ACQ_REL) == td->nexpected_ids)
+                    __atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+}
+
+static void quad_decode_budgeted(apriltag_detector_t *td, image_u8_t *im,
+                                 zarray_t *quads, zarray_t *detections)
+{
+    int nquads = zarray_size(quads);
+    struct quad_priority *priorities = malloc(sizeof(struct quad_priority) * (nquads + 1));
+
+    for (int i = 0; i < nquads; i++) {
+        struct quad *quad;
+        zarray_get_volatile(quads, i, &quad);
+        priorities[i].idx = i;
+        priorities[i].priority = quad_decode_priority(im, quad);
+    }
+
+    qsort(priorities, nquads, sizeof(struct quad_priority), quad_priority_compare);
+
+    struct quad_decode_budget b;
+    memset(&b, 0, sizeof(b));
+    b.td = td;
+    b.im = im;
+    b.quads = quads;
+
+    b.norder = nquads;
+    if (td->max_decode_quads > 0 && td->max_decode_quads < nquads)
+        b.norder = td->max_decode_quads;
+
+    b.order = malloc(sizeof(int) * (b.norder + 1));
+    for (int k = 0; k < b.norder; k++)
+        b.order[k] = priorities[k].idx;
+    free(priorities);
+
+    b.results = calloc(b.norder + 1, sizeof(zarray_t*));
+    b.found = calloc(td->nexpected_ids + 1, sizeof(int));
+
+    if (td->decode_budget_us > 0)
+        b.deadline_utime = utime_now() + td->decode_budget_us;
+
+    // every task runs until the order is used up (or a limit is
+    // reached), so one per thread is enough.
+    int ntasks = imin(td->nthreads, b.norder);
+    for (int i = 0; i < ntasks; i++)
+        workerpool_add_task(td->wp, quad_decode_budget_task, &b);
+
+    workerpool_run(td->wp);
+
+    td->ndecoded = 0;
+    for (int k = 0; k < b.norder; k++) {
+        if (b.results[k] == NULL)
+            continue;
+
+        td->ndecoded++;
+        zarray_add_all(detections, b.results[k]);
+        zarray_destroy(b.results[k]);
+    }
+
+    free(b.order);
+    free(b.results);
+    free(b.found);
+}
+
 void apriltag_detection_destroy(apriltag_detection_t *det)
 {
     if (det == NULL)
@@ -849,25 +1085,402 @@ void apriltag_detection_destroy(apriltag_detection_t *det)
     free(det);
 }
 
-zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
+// Improve the corners of a quad that was fit on a lower resolution
+// image, or predicted from a previous frame. Along each edge, we look
+// up to range pixels (of im) to either side for the strongest step
+// from the dark border to the lighter outside, fit a new line to
+// those points, and intersect adjacent lines.
+double apriltag_quad_refine_edges(image_u8_t *im, struct quad *quad, double range)
 {
-    if (zarray_size(td->tag_families) == 0) {
-        zarray_t *s = zarray_create(sizeof(apriltag_detection_t*));
-        printf("apriltag.c: No tag families enabled.");
-        return s;
+    double cx = 0, cy = 0;
+    for (int i = 0; i < 4; i++) {
+        cx += quad->p[i][0] / 4;
+        cy += quad->p[i][1] / 4;
+    }
+
+    double lines[4][4]; // a point on the line, and the line's normal
+    double residual = 0;
+
+    for (int edge = 0; edge < 4; edge++) {
+        int a = edge, b = (edge + 1) & 3;
+
+        double dx = quad->p[b][0] - quad->p[a][0];
+        double dy = quad->p[b][1] - quad->p[a][1];
+        double len = sqrt(dx*dx + dy*dy);
+        if (len < 1)
+            return -1;
+
+        // point the normal out of the quad.
+        double nx = dy / len, ny = -dx / len;
+        double mx = (quad->p[a][0] + quad->p[b][0]) / 2;
+        double my = (quad->p[a][1] + quad->p[b][1]) / 2;
+
+        if ((mx - cx)*nx + (my - cy)*ny < 0) {
+            nx = -nx;
+            ny = -ny;
+        }
+
+        // XXX Tunable. Sample more points on bigger tags, but stay
+        // away from the corners, which are the least reliable.
+        int nsamples = imax(16, len / 8);
+
+        double Mx = 0, My = 0, Mxx = 0, Mxy = 0, Myy = 0;
+        int N = 0;
+
+        for (int sample = 0; sample < nsamples; sample++) {
+            double alpha = (1.0 + sample) / (nsamples + 1);
+            double x0 = alpha*quad->p[a][0] + (1 - alpha)*quad->p[b][0];
+            double y0 = alpha*quad->p[a][1] + (1 - alpha)*quad->p[b][1];
+
+            // weighted mean of the offsets along the normal, by
+            // squared gradient. XXX Tunable step size.
+            double Mn = 0, Mcount = 0;
+
+            for (double n = -range; n <= range; n += 0.25) {
+                int xout = x0 + (n + 1)*nx, yout = y0 + (n + 1)*ny;
+                int xin = x0 + (n - 1)*nx, yin = y0 + (n - 1)*ny;
+
+                if (xout < 0 || xout >= im->width || yout < 0 || yout >= im->height ||
+                    xin < 0 || xin >= im->width || yin < 0 || yin >= im->height)
+                    continue;
+
+                int gout = im->buf[yout*im->stride + xout];
+                int gin = im->buf[yin*im->stride + xin];
+
+                // only dark-to-light steps belong to the tag border.
+                if (gout <= gin)
+                    continue;
+
+                double weight = (gout - gin) * (gout - gin);
+                Mn += weight * n;
+                Mcount += weight;
+            }
+
+            if (Mcount == 0)
+                continue;
+
+            double x = x0 + Mn / Mcount * nx;
+            double y = y0 + Mn / Mcount * ny;
+
+            Mx += x;
+            My += y;
+            Mxx += x*x;
+            Mxy += x*y;
+            Myy += y*y;
+            N++;
+        }
+
+        // most of an edge should be visible for the fit to be
+        // trusted.
+        if (2*N < nsamples)
+            residual = -1;
+
+        if (N < 2) {
+            // keep the edge we had.
+            lines[edge][0] = mx;
+            lines[edge][1] = my;
+            lines[edge][2] = nx;
+            lines[edge][3] = ny;
+            continue;
+        }
+
+        double Ex = Mx / N, Ey = My / N;
+        double Cxx = Mxx / N - Ex*Ex;
+        double Cxy = Mxy / N - Ex*Ey;
+        double Cyy = Myy / N - Ey*Ey;
+
+        double normal_theta = .5 * atan2(-2*Cxy, (Cyy - Cxx));
+
+        // RMS distance of the points from the line: the square root
+        // of the smaller eigenvalue of their covariance.
+        double lambda = (Cxx + Cyy)/2 - sqrt(sq((Cxx - Cyy)/2) + Cxy*Cxy);
+        if (residual >= 0)
+            residual = fmax(residual, sqrt(fmax(0, lambda)));
+
+        lines[edge][0] = Ex;
+        lines[edge][1] = Ey;
+        lines[edge][2] = cos(normal_theta);
+        lines[edge][3] = sin(normal_theta);
+    }
+
+    // corner i+1 is where edges i and i+1 meet:
+    //   n_i . p = n_i . E_i, and likewise for i+1.
+    for (int i = 0; i < 4; i++) {
+        double *l0 = lines[i], *l1 = lines[(i + 1) & 3];
+
+        double det = l0[2]*l1[3] - l0[3]*l1[2];
+        if (fabs(det) < 0.001) {
+            residual = -1;
+            continue; // nearly parallel; keep the corner we had.
+        }
+
+        double b0 = l0[2]*l0[0] + l0[3]*l0[1];
+        double b1 = l1[2]*l1[0] + l1[3]*l1[1];
+
+        double x = (b0*l1[3] - b1*l0[3]) / det;
+        double y = (l0[2]*b1 - l1[2]*b0) / det;
+
+        // a corner shouldn't move further than we searched.
+        float *p = quad->p[(i + 1) & 3];
+        if (fabs(x - p[0]) > 2*range || fabs(y - p[1]) > 2*range) {
+            residual = -1;
+            continue;
+        }
+
+        p[0] = x;
+        p[1] = y;
+    }
+
+    return residual;
+}
+
+// A rectangular window, [x0, x1) x [y0, y1), of an image (or of one
+// pyramid level).
+struct image_roi
+{
+    int x0, y0, x1, y1;
+};
+
+// XXX Tunable. On a coarse level, a tag not much bigger than a dozen
+// pixels tends to blur into a single tangle of edges that neither
+// fits nor decodes. So clusters smaller than PYRAMID_SMALL_CLUSTER
+// pixels are searched for again on the next finer level, in a window
+// PYRAMID_ROI_MARGIN (finer level) pixels larger on each side.
+#define PYRAMID_SMALL_CLUSTER 24
+#define PYRAMID_ROI_MARGIN 8
+
+static image_u8_t *image_u8_crop(const image_u8_t *im, const struct image_roi *roi)
+{
+    image_u8_t *out = image_u8_create(roi->x1 - roi->x0, roi->y1 - roi->y0);
+
+    for (int y = roi->y0; y < roi->y1; y++)
+        memcpy(&out->buf[(y - roi->y0)*out->stride], &im->buf[y*im->stride + roi->x0], out->width);
+
+    return out;
+}
+
+// Does q, found in the window roi of a width x height image, come
+// within margin pixels of an edge of the window that is not also an
+// edge of the image? Such a quad may have been cut off.
+static int quad_cut_by_roi(const struct quad *q, const struct image_roi *roi,
+                           int width, int height, double margin)
+{
+    int cut = 0;
+    for (int k = 0; k < 4; k++) {
+        cut |= (roi->x0 > 0 && q->p[k][0] < margin) ||
+            (roi->y0 > 0 && q->p[k][1] < margin) ||
+            (roi->x1 < width && q->p[k][0] > roi->x1 - roi->x0 - 1 - margin) ||
+            (roi->y1 < height && q->p[k][1] > roi->y1 - roi->y0 - 1 - margin);
+    }
+    return cut;
+}
+
+// Add roi to rois, first merging it with any window it overlaps
+// (repeatedly, since the union may overlap others).
+static void image_rois_add_merged(zarray_t *rois, struct image_roi roi)
+{
+    for (int k = 0; k < zarray_size(rois); ) {
+        struct image_roi *r;
+        zarray_get_volatile(rois, k, &r);
+
+        if (r->x0 < roi.x1 && roi.x0 < r->x1 && r->y0 < roi.y1 && roi.y0 < r->y1) {
+            roi.x0 = imin(roi.x0, r->x0);
+            roi.y0 = imin(roi.y0, r->y0);
+            roi.x1 = imax(roi.x1, r->x1);
+            roi.y1 = imax(roi.y1, r->y1);
+            zarray_remove_index(rois, k, 1);
+            k = 0;
+        } else {
+            k++;
+        }
+    }
+
+    zarray_add(rois, &roi);
+}
+
+// Search quad_im for quads on td->pyramid_levels levels, coarse to
+// fine. Returns quads in quad_im coordinates; levels receives (as
+// ints) the level each one was found on.
+static zarray_t *quads_pyramid(apriltag_detector_t *td, image_u8_t *quad_im, zarray_t *levels)
+{
+    int nlevels = 1;
+    image_u8_t *pyr[td->pyramid_levels];
+    pyr[0] = quad_im;
+
+    // don't go below a couple of tiles of the thresholder.
+    while (nlevels < td->pyramid_levels &&
+           pyr[nlevels-1]->width >= 64 && pyr[nlevels-1]->height >= 64) {
+        pyr[nlevels] = image_u8_decimate(pyr[nlevels-1], 2);
+        nlevels++;
+    }
+
+    timeprofile_stamp(td->tp, "pyramid");
+
+    zarray_t *quads = zarray_create(sizeof(struct quad));
+    zarray_t *rois = zarray_create(sizeof(struct image_roi));
+
+    struct image_roi all = { 0, 0, pyr[nlevels-1]->width, pyr[nlevels-1]->height };
+    zarray_add(rois, &all);
+
+    for (int level = nlevels - 1; level >= 0 && zarray_size(rois) > 0; level--) {
+        image_u8_t *im = pyr[level];
+        int small_size = level > 0 ? PYRAMID_SMALL_CLUSTER : 0;
+
+        zarray_t *small = zarray_create(4*sizeof(int));
+
+        for (int i = 0; i < zarray_size(rois); i++) {
+            struct image_roi roi;
+            zarray_get(rois, i, &roi);
+
+            int whole = roi.x0 == 0 && roi.y0 == 0 && roi.x1 == im->width && roi.y1 == im->height;
+            image_u8_t *sub = whole ? im : image_u8_crop(im, &roi);
+
+            int small0 = zarray_size(small);
+            zarray_t *subquads = apriltag_quad_thresh_small(td, sub, small_size, small);
+
+            for (int j = 0; j < zarray_size(subquads); j++) {
+                struct quad q;
+                zarray_get(subquads, j, &q);
+
+                if (quad_cut_by_roi(&q, &roi, im->width, im->height, 1))
+                    continue;
+
+                for (int k = 0; k < 4; k++) {
+                    q.p[k][0] += roi.x0;
+                    q.p[k][1] += roi.y0;
+                }
+
+                zarray_add(quads, &q);
+                zarray_add(levels, &level);
+            }
+
+            for (int j = small0; j < zarray_size(small); j++) {
+                int *box;
+                zarray_get_volatile(small, j, &box);
+                box[0] += roi.x0;
+                box[1] += roi.y0;
+                box[2] += roi.x0;
+                box[3] += roi.y0;
+            }
+
+            zarray_destroy(subquads);
+            if (sub != im)
+                image_u8_destroy(sub);
+        }
+
+        zarray_clear(rois);
+
+        if (level == 0) {
+            zarray_destroy(small);
+            break;
+        }
+
+        // windows for the next level, around each small cluster. (We
+        // can't skip those inside a quad found on this level: a quad
+        // around a tag's white margin may well fail to decode.)
+        image_u8_t *finer = pyr[level-1];
+        int64_t area = 0;
+
+        for (int j = 0; j < zarray_size(small); j++) {
+            int *box;
+            zarray_get_volatile(small, j, &box);
+
+            struct image_roi roi = {
+                .x0 = imax(0, 2*box[0] - PYRAMID_ROI_MARGIN),
+                .y0 = imax(0, 2*box[1] - PYRAMID_ROI_MARGIN),
+                .x1 = imin(finer->width, 2*(box[2] + 1) + PYRAMID_ROI_MARGIN),
+                .y1 = imin(finer->height, 2*(box[3] + 1) + PYRAMID_ROI_MARGIN) };
+
+            image_rois_add_merged(rois, roi);
+        }
+
+        for (int j = 0; j < zarray_size(rois); j++) {
+            struct image_roi *r;
+            zarray_get_volatile(rois, j, &r);
+            area += (int64_t) (r->x1 - r->x0) * (r->y1 - r->y0);
+        }
+
+        // XXX Tunable: when the windows cover most of the level, one
+        // search of the whole level is cheaper.
+        if (area > (int64_t) finer->width * finer->height / 2) {
+            zarray_clear(rois);
+            struct image_roi whole = { 0, 0, finer->width, finer->height };
+            zarray_add(rois, &whole);
+        }
+
+        zarray_destroy(small);
+    }
+
+    zarray_destroy(rois);
+
+    // back to quad_im coordinates.
+    for (int i = 0; i < zarray_size(quads); i++) {
+        struct quad *q;
+        int level;
+        zarray_get_volatile(quads, i, &q);
+        zarray_get(levels, i, &level);
+
+        for (int k = 0; k < 4; k++) {
+            q->p[k][0] *= 1 << level;
+            q->p[k][1] *= 1 << level;
+        }
     }
 
+    for (int i = 1; i < nlevels; i++)
+        image_u8_destroy(pyr[i]);
+
+    return quads;
+}
+
+static void detector_ensure_workerpool(apriltag_detector_t *td)
+{
     if (td->wp == NULL || td->nthreads != workerpool_get_nthreads(td->wp)) {
         workerpool_destroy(td->wp);
         td->wp = workerpool_create(td->nthreads);
     }
+}
+
+void apriltag_quads_clear(zarray_t *quads)
+{
+    for (int i = 0; i < zarray_size(quads); i++) {
+        struct quad *quad;
+        zarray_get_volatile(quads, i, &quad);
+
+        // (quads that were never decoded have no homographies.)
+        if (quad->H)
+            matd_destroy(quad->H);
+        if (quad->Hinv)
+            matd_destroy(quad->Hinv);
+    }
+
+    zarray_clear(quads);
+}
+
+void apriltag_quads_destroy(zarray_t *quads)
+{
+    if (quads == NULL)
+        return;
+
+    apriltag_quads_clear(quads);
+    zarray_destroy(quads);
+}
+
+static void detect_begin(apriltag_detector_t *td)
+{
+    detector_ensure_workerpool(td);
 
+    workerpool_reset_busy_utime(td->wp);
     timeprofile_clear(td->tp);
     timeprofile_stamp(td->tp, "init");
+}
 
-    ///////////////////////////////////////////////////////////
-    // Step 1. Detect quads according to requested image decimation
-    // and blurring parameters.
+// Find quads in im_orig and append them (in im_orig coordinates) to
+// quads_out. Only a search of the whole frame (whole != 0) may use
+// or update the incremental quad cache.
+static void detect_quads_image(apriltag_detector_t *td, image_u8_t *im_orig, int whole, zarray_t *quads_out)
+{
+    // Detect quads according to requested image decimation and
+    // blurring parameters.
     image_u8_t *quad_im = im_orig;
     if (td->quad_decimate > 1) {
         quad_im = image_u8_decimate(im_orig, td->quad_decimate);
@@ -892,6 +1505,9 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
             ksz++;
 
         if (ksz > 1) {
+            // never filter the caller's image in place.
+            if (quad_im == im_orig)
+                quad_im = image_u8_copy(im_orig);
 
             if (td->quad_sigma > 0) {
                 // Apply a blur
@@ -925,8 +1541,16 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
     if (td->debug)
         image_u8_write_pnm(quad_im, "debug_preprocess.pnm");
 
-//    zarray_t *quads = apriltag_quad_gradient(td, im_orig);
-    zarray_t *quads = apriltag_quad_thresh(td, quad_im);
+    zarray_t *quads;
+    zarray_t *quad_levels = NULL;
+
+    if (td->pyramid_levels > 1) {
+        quad_levels = zarray_create(sizeof(int));
+        quads = quads_pyramid(td, quad_im, quad_levels);
+    } else if (whole)
+        quads = apriltag_quad_thresh(td, quad_im);
+    else
+        quads = apriltag_quad_thresh_small(td, quad_im, 0, NULL);
 
     // adjust centers of pixels so that they correspond to the
     // original full-resolution image.
@@ -942,12 +1566,36 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         }
     }
 
+    // quads from the pyramid may come from a much coarser image than
+    // quad_decimate suggests; refine them at full resolution.
+    if (quad_levels != NULL) {
+        for (int i = 0; i < zarray_size(quads); i++) {
+            struct quad *q;
+            int level;
+            zarray_get_volatile(quads, i, &q);
+            zarray_get(quad_levels, i, &level);
+
+            double factor = fmax(1, td->quad_decimate) * (1 << level);
+            apriltag_quad_refine_edges(im_orig, q, factor + 1);
+        }
+
+        zarray_destroy(quad_levels);
+        timeprofile_stamp(td->tp, "refine edges");
+    }
+
     if (quad_im != im_orig)
         image_u8_destroy(quad_im);
 
-    zarray_t *detections = zarray_create(sizeof(apriltag_detection_t*));
+    zarray_add_all(quads_out, quads);
+    zarray_destroy(quads);
+}
 
-    td->nquads = zarray_size(quads);
+void apriltag_detector_detect_quads(apriltag_detector_t *td, image_u8_t *im_orig, zarray_t *quads_out)
+{
+    detect_begin(td);
+    detect_quads_image(td, im_orig, 1, quads_out);
+
+    td->nquads = zarray_size(quads_out);
 
     timeprofile_stamp(td->tp, "quads");
 
@@ -958,9 +1606,9 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
 
         srandom(0);
 
-        for (int i = 0; i < zarray_size(quads); i++) {
+        for (int i = 0; i < zarray_size(quads_out); i++) {
             struct quad *quad;
-            zarray_get_volatile(quads, i, &quad);
+            zarray_get_volatile(quads_out, i, &quad);
 
             const int bias = 100;
             int color = bias + (random() % (255-bias));
@@ -974,37 +1622,66 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         image_u8_write_pnm(im_quads, "debug_quads_raw.pnm");
         image_u8_destroy(im_quads);
     }
+}
+
+void apriltag_detector_decode_quads(apriltag_detector_t *td, image_u8_t *im_orig,
+                                    zarray_t *quads, zarray_t *detections)
+{
+    detector_ensure_workerpool(td);
 
     ////////////////////////////////////////////////////////////////
-    // Step 2. Decode tags from each quad.
-    if (1) {
+    if (td->max_decode_quads > 0 || td->decode_budget_us > 0 || td->nexpected_ids > 0) {
+        quad_decode_budgeted(td, im_orig, quads, detections);
+    } else {
+        td->ndecoded = zarray_size(quads);
+
         image_u8_t *im_gray_samples = td->debug ? image_u8_copy(im_orig) : NULL;
 
         // im_decision debugging output is slow.
         image_u8_t *im_decision = td->debug ? image_u8_copy(im_orig) : NULL;
 
-        int chunksize = 1 + zarray_size(quads) / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
+        int nquads = zarray_size(quads);
+        double *costs = malloc(sizeof(double) * (nquads + 1));
+        int *bounds = malloc(sizeof(int) * (nquads + 1));
+
+        for (int i = 0; i < nquads; i++) {
+            struct quad *quad;
+            zarray_get_volatile(quads, i, &quad);
+            costs[i] = quad_decode_cost(td, quad);
+        }
+
+        int ntasks = workerpool_partition(costs, nquads, APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads, bounds);
+        struct quad_decode_task *tasks = malloc(sizeof(struct quad_decode_task) * (ntasks + 1));
 
-        struct quad_decode_task tasks[zarray_size(quads) / chunksize + 1];
+        for (int i = 0; i < ntasks; i++) {
+            tasks[i].i0 = bounds[i];
+            tasks[i].i1 = bounds[i+1];
+            tasks[i].quads = quads;
+            tasks[i].td = td;
+            tasks[i].im = im_orig;
+            tasks[i].detections = zarray_create(sizeof(apriltag_detection_t*));
 
-        int ntasks = 0;
-        for (int i = 0; i < zarray_size(quads); i+= chunksize) {
-            tasks[ntasks].i0 = i;
-            tasks[ntasks].i1 = imin(zarray_size(quads), i + chunksize);
-            tasks[ntasks].quads = quads;
-            tasks[ntasks].td = td;
-            tasks[ntasks].im = im_orig;
-            tasks[ntasks].detections = detections;
+            tasks[i].im_gray_samples = im_gray_samples;
+            tasks[i].im_decision = im_decision;
 
-            tasks[ntasks].im_gray_samples = im_gray_samples;
-            tasks[ntasks].im_decision = im_decision;
+            double cost = 0;
+            for (int j = bounds[i]; j < bounds[i+1]; j++)
+                cost += costs[j];
 
-            workerpool_add_task(td->wp, quad_decode_task, &tasks[ntasks]);
-            ntasks++;
+            workerpool_add_task_cost(td->wp, quad_decode_task, &tasks[i], cost);
         }
 
         workerpool_run(td->wp);
 
+        for (int i = 0; i < ntasks; i++) {
+            zarray_add_all(detections, tasks[i].detections);
+            zarray_destroy(tasks[i].detections);
+        }
+
+        free(tasks);
+        free(bounds);
+        free(costs);
+
         if (im_gray_samples != NULL) {
             image_u8_write_pnm(im_gray_samples, "debug_gray_samples.pnm");
             image_u8_destroy(im_gray_samples);
@@ -1041,67 +1718,129 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         image_u8_destroy(im_quads);
     }
 
+
     timeprofile_stamp(td->tp, "decode+refinement");
+}
 
-    ////////////////////////////////////////////////////////////////
-    // Step 3. Reconcile detections--- don't report the same tag more
-    // than once. (Allow non-overlapping duplicate detections.)
-    if (1) {
-        zarray_t *poly0 = g2d_polygon_create_data((double[4][2]) {}, 4);
-        zarray_t *poly1 = g2d_polygon_create_data((double[4][2]) {}, 4);
+// Do two detections' quads overlap (including one containing the
+// other)? Tag quads are convex, so they don't exactly when the
+// corners of one lie entirely beyond some edge of the other
+// (separating axes).
+static int detection_quads_overlap(const double pa[4][2], const double pb[4][2])
+{
+    for (int pass = 0; pass < 2; pass++) {
+        const double (*p)[2] = pass ? pb : pa;
+        const double (*q)[2] = pass ? pa : pb;
+
+        for (int i = 0; i < 4; i++) {
+            int j = (i + 1) & 3;
+            double nx = p[j][1] - p[i][1], ny = p[i][0] - p[j][0];
+
+            double pmin = HUGE_VAL, pmax = -HUGE_VAL;
+            double qmin = HUGE_VAL, qmax = -HUGE_VAL;
+            for (int k = 0; k < 4; k++) {
+                double dp = nx*p[k][0] + ny*p[k][1];
+                double dq = nx*q[k][0] + ny*q[k][1];
+                pmin = fmin(pmin, dp);
+                pmax = fmax(pmax, dp);
+                qmin = fmin(qmin, dq);
+                qmax = fmax(qmax, dq);
+            }
+
+            if (qmax < pmin || qmin > pmax)
+                return 0;
+        }
+    }
+
+    return 1;
+}
 
-        for (int i0 = 0; i0 < zarray_size(detections); i0++) {
+struct detection_ref
+{
+    apriltag_detection_t *det;
+    int idx;
+};
 
-            apriltag_detection_t *det0;
-            zarray_get(detections, i0, &det0);
+static int detection_ref_compare(const void *_a, const void *_b)
+{
+    const struct detection_ref *a = _a, *b = _b;
+
+    if (a->det->family != b->det->family)
+        return (uintptr_t) a->det->family < (uintptr_t) b->det->family ? -1 : 1;
+    if (a->det->id != b->det->id)
+        return a->det->id - b->det->id;
+
+    // then best first: fewest bit errors, then most goodness, then
+    // (as before) the later detection.
+    if (a->det->hamming != b->det->hamming)
+        return a->det->hamming - b->det->hamming;
+    if (a->det->goodness != b->det->goodness)
+        return a->det->goodness > b->det->goodness ? -1 : 1;
+    return b->idx - a->idx;
+}
 
-            for (int k = 0; k < 4; k++)
-                zarray_set(poly0, k, det0->p[k], NULL);
+void apriltag_detector_reconcile(apriltag_detector_t *td, zarray_t *detections)
+{
+    // Reconcile detections--- don't report the same tag more
+    // than once. (Allow non-overlapping duplicate detections.)
+    //
+    // Only detections of the same family and id are compared, so
+    // group them, best first within a group. Each detection we keep
+    // drops the worse ones of its group that overlap it.
+    int n = zarray_size(detections);
+    if (n > 1) {
+        struct detection_ref *refs = malloc(sizeof(struct detection_ref) * n);
+        uint8_t *dead = calloc(n, sizeof(uint8_t));
+
+        for (int i = 0; i < n; i++) {
+            zarray_get(detections, i, &refs[i].det);
+            refs[i].idx = i;
+        }
 
-            for (int i1 = i0+1; i1 < zarray_size(detections); i1++) {
+        qsort(refs, n, sizeof(struct detection_ref), detection_ref_compare);
 
-                apriltag_detection_t *det1;
-                zarray_get(detections, i1, &det1);
+        for (int g0 = 0, g1; g0 < n; g0 = g1) {
+            for (g1 = g0 + 1; g1 < n; g1++) {
+                if (refs[g1].det->family != refs[g0].det->family || refs[g1].det->id != refs[g0].det->id)
+                    break;
+            }
 
-                if (det0->id != det1->id || det0->family != det1->family)
+            for (int i0 = g0; i0 < g1; i0++) {
+                if (dead[refs[i0].idx])
                     continue;
 
-                for (int k = 0; k < 4; k++)
-                    zarray_set(poly1, k, det1->p[k], NULL);
-
-                if (g2d_polygon_overlaps_polygon(poly0, poly1)) {
-                    // the tags overlap. Delete one, keep the other.
-
-                    if (det0->hamming < det1->hamming ||
-                        (det0->hamming == det1->hamming && det0->goodness > det1->goodness)) {
-                        // keep det0, destroy det1
-                        apriltag_detection_destroy(det1);
-                        zarray_remove_index(detections, i1, 1);
-                        i1--; // retry the same index
-                        goto retry1;
-                    } else {
-                        // keep det1, destroy det0
-                        apriltag_detection_destroy(det0);
-                        zarray_remove_index(detections, i0, 1);
-                        i0--; // retry the same index.
-                        goto retry0;
-                    }
+                for (int i1 = i0 + 1; i1 < g1; i1++) {
+                    if (!dead[refs[i1].idx] && detection_quads_overlap(refs[i0].det->p, refs[i1].det->p))
+                        dead[refs[i1].idx] = 1;
                 }
-
-              retry1: ;
             }
+        }
+
+        // compact the survivors, in their original order.
+        int nkeep = 0;
+        for (int i = 0; i < n; i++) {
+            apriltag_detection_t *det;
+            zarray_get(detections, i, &det);
 
-          retry0: ;
+            if (dead[i])
+                apriltag_detection_destroy(det);
+            else
+                zarray_set(detections, nkeep++, &det, NULL);
         }
+        zarray_truncate(detections, nkeep);
 
-        zarray_destroy(poly0);
-        zarray_destroy(poly1);
+        free(refs);
+        free(dead);
     }
 
+    zarray_sort(detections, detection_compare_function);
     timeprofile_stamp(td->tp, "reconcile");
+}
 
-    ////////////////////////////////////////////////////////////////
-    // Produce final debug output
+// Produce final debug output, if td->debug.
+static void detect_debug_output(apriltag_detector_t *td, image_u8_t *im_orig,
+                                zarray_t *quads, zarray_t *detections)
+{
     if (td->debug) {
 
         image_u8_t *darker = image_u8_copy(im_orig);
@@ -1158,7 +1897,6 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         fclose(f);
     }
 
-    // deallocate
     if (td->debug) {
         FILE *f = fopen("debug_quads.ps", "w");
         fprintf(f, "%%!PS\n\n");
@@ -1196,20 +1934,225 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
 
         fclose(f);
     }
+}
+
+zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
+{
+    if (zarray_size(td->tag_families) == 0) {
+        zarray_t *s = zarray_create(sizeof(apriltag_detection_t*));
+        printf("apriltag.c: No tag families enabled.");
+        return s;
+    }
+
+    zarray_t *quads = zarray_create(sizeof(struct quad));
+    zarray_t *detections = zarray_create(sizeof(apriltag_detection_t*));
+
+    apriltag_detector_detect_quads(td, im_orig, quads);
+    apriltag_detector_decode_quads(td, im_orig, quads, detections);
+    apriltag_detector_reconcile(td, detections);
+
+    detect_debug_output(td, im_orig, quads, detections);
 
     timeprofile_stamp(td->tp, "debug output");
 
-    for (int i = 0; i < zarray_size(quads); i++) {
-        struct quad *quad;
-        zarray_get_volatile(quads, i, &quad);
-        matd_destroy(quad->H);
-        matd_destroy(quad->Hinv);
+    apriltag_quads_destroy(quads);
+    timeprofile_stamp(td->tp, "cleanup");
+
+    return detections;
+}
+
+zarray_t *apriltag_detector_detect_rois(apriltag_detector_t *td, image_u8_t *im_orig,
+                                        const apriltag_roi_t *rects, int nrects)
+{
+    zarray_t *detections = zarray_create(sizeof(apriltag_detection_t*));
+
+    if (zarray_size(td->tag_families) == 0) {
+        printf("apriltag.c: No tag families enabled.");
+        return detections;
     }
 
-    zarray_destroy(quads);
+    detect_begin(td);
+
+    // clip the rectangles to the image and merge overlapping ones,
+    // so that no part of the image is searched twice.
+    zarray_t *rois = zarray_create(sizeof(struct image_roi));
+
+    // start windows on the decimation grid of the whole image, so a
+    // tag decimates the same way whichever window it is found in.
+    int align = 1;
+    if (td->quad_decimate == 1.5)
+        align = 3;
+    else if (td->quad_decimate > 1)
+        align = (int) td->quad_decimate;
+
+    for (int i = 0; i < nrects; i++) {
+        struct image_roi roi = {
+            .x0 = imax(0, rects[i].x - rects[i].x % align),
+            .y0 = imax(0, rects[i].y - rects[i].y % align),
+            .x1 = imin(im_orig->width, rects[i].x + rects[i].width),
+            .y1 = imin(im_orig->height, rects[i].y + rects[i].height) };
+
+        // XXX Tunable. Too small to hold a tag.
+        if (roi.x1 - roi.x0 < 8 || roi.y1 - roi.y0 < 8)
+            continue;
 
-    zarray_sort(detections, detection_compare_function);
+        image_rois_add_merged(rois, roi);
+    }
+
+    timeprofile_stamp(td->tp, "rois");
+
+    zarray_t *quads = zarray_create(sizeof(struct quad));
+    zarray_t *subquads = zarray_create(sizeof(struct quad));
+
+    // quads are found to within about one (decimated) pixel of the
+    // window's edge before they count as cut off.
+    double margin = fmax(1, td->quad_decimate);
+
+    for (int i = 0; i < zarray_size(rois); i++) {
+        struct image_roi roi;
+        zarray_get(rois, i, &roi);
+
+        int whole = roi.x0 == 0 && roi.y0 == 0 && roi.x1 == im_orig->width && roi.y1 == im_orig->height;
+        image_u8_t *sub = whole ? im_orig : image_u8_crop(im_orig, &roi);
+
+        detect_quads_image(td, sub, whole, subquads);
+
+        for (int j = 0; j < zarray_size(subquads); j++) {
+            struct quad q;
+            zarray_get(subquads, j, &q);
+
+            if (quad_cut_by_roi(&q, &roi, im_orig->width, im_orig->height, margin))
+                continue;
+
+            for (int k = 0; k < 4; k++) {
+                q.p[k][0] += roi.x0;
+                q.p[k][1] += roi.y0;
+            }
+
+            zarray_add(quads, &q);
+        }
+
+        // the quads have no homographies yet, so there is nothing
+        // else to free.
+        zarray_clear(subquads);
+
+        if (sub != im_orig)
+            image_u8_destroy(sub);
+    }
+
+    zarray_destroy(subquads);
+    zarray_destroy(rois);
+
+    td->nquads = zarray_size(quads);
+    timeprofile_stamp(td->tp, "quads");
+
+    // decode at full resolution, in full image coordinates.
+    apriltag_detector_decode_quads(td, im_orig, quads, detections);
+    apriltag_detector_reconcile(td, detections);
+
+    detect_debug_output(td, im_orig, quads, detections);
+
+    timeprofile_stamp(td->tp, "debug output");
+
+    apriltag_quads_destroy(quads);
     timeprofile_stamp(td->tp, "cleanup");
 
     return detections;
 }
+
+apriltag_detect_context_t *apriltag_detect_context_create(int nthreads)
+{
+    apriltag_detect_context_t *ctx = calloc(1, sizeof(apriltag_detect_context_t));
+
+    ctx->wp = workerpool_create(nthreads > 0 ? nthreads : 1);
+    ctx->tp = timeprofile_create();
+
+    return ctx;
+}
+
+void apriltag_detect_context_destroy(apriltag_detect_context_t *ctx)
+{
+    if (ctx == NULL)
+        return;
+
+    workerpool_destroy(ctx->wp);
+    timeprofile_destroy(ctx->tp);
+    apriltag_quad_cache_destroy(ctx->quad_cache);
+    free(ctx);
+}
+
+// The _ctx calls run the same code as the others on a copy of td
+// whose per-call state is ctx's, then keep that state (which the call
+// may have updated) in ctx. td itself is never written.
+static void context_bind(apriltag_detector_t *tdc, const apriltag_detector_t *td,
+                         const apriltag_detect_context_t *ctx)
+{
+    memcpy(tdc, td, sizeof(apriltag_detector_t));
+
+    tdc->nthreads = workerpool_get_nthreads(ctx->wp);
+    tdc->wp = ctx->wp;
+    tdc->tp = ctx->tp;
+    tdc->nedges = ctx->nedges;
+    tdc->nsegments = ctx->nsegments;
+    tdc->nquads = ctx->nquads;
+    tdc->ndecoded = ctx->ndecoded;
+    tdc->quad_cache = ctx->quad_cache;
+}
+
+static void context_unbind(apriltag_detect_context_t *ctx, const apriltag_detector_t *tdc)
+{
+    ctx->nedges = tdc->nedges;
+    ctx->nsegments = tdc->nsegments;
+    ctx->nquads = tdc->nquads;
+    ctx->ndecoded = tdc->ndecoded;
+    ctx->quad_cache = tdc->quad_cache;
+}
+
+zarray_t *apriltag_detector_detect_ctx(const apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                       image_u8_t *im_orig)
+{
+    apriltag_detector_t tdc;
+    context_bind(&tdc, td, ctx);
+    zarray_t *detections = apriltag_detector_detect(&tdc, im_orig);
+    context_unbind(ctx, &tdc);
+
+    return detections;
+}
+
+zarray_t *apriltag_detector_detect_rois_ctx(const apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                            image_u8_t *im_orig, const apriltag_roi_t *rects, int nrects)
+{
+    apriltag_detector_t tdc;
+    context_bind(&tdc, td, ctx);
+    zarray_t *detections = apriltag_detector_detect_rois(&tdc, im_orig, rects, nrects);
+    context_unbind(ctx, &tdc);
+
+    return detections;
+}
+
+void apriltag_detector_detect_quads_ctx(const apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                        image_u8_t *im_orig, zarray_t *quads)
+{
+    apriltag_detector_t tdc;
+    context_bind(&tdc, td, ctx);
+    apriltag_detector_detect_quads(&tdc, im_orig, quads);
+    context_unbind(ctx, &tdc);
+}
+
+void apriltag_detector_decode_quads_ctx(const apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                        image_u8_t *im_orig, zarray_t *quads, zarray_t *detections)
+{
+    apriltag_detector_t tdc;
+    context_bind(&tdc, td, ctx);
+    apriltag_detector_decode_quads(&tdc, im_orig, quads, detections);
+    context_unbind(ctx, &tdc);
+}
+
+void apriltag_detector_reconcile_ctx(const apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                     zarray_t *detections)
+{
+    apriltag_detector_t tdc;
+    context_bind(&tdc, td, ctx);
+    apriltag_detector_reconcile(&tdc, detections);
+    context_unbind(ctx, &tdc);
+}
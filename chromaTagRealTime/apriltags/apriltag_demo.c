@@ -65,6 +65,7 @@ int main(int argc, char *argv[])
     getopt_add_double(getopt, 'b', "blur", "0.0", "Apply low-pass blur to input");
     getopt_add_bool(getopt, '1', "refine-decode", 0, "Spend more time trying to decode tags");
     getopt_add_bool(getopt, '2', "refine-pose", 0, "Spend more time trying to precisely localize tags");
+    getopt_add_int(getopt, 'p', "pyramid", "1", "Search for quads coarse-to-fine on this many pyramid levels");
 
     if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
         printf("Usage: %s [options] <input files>\n", argv[0]);
@@ -101,6 +102,7 @@ int main(int argc, char *argv[])
     td->debug = getopt_get_bool(getopt, "debug");
     td->refine_decode = getopt_get_bool(getopt, "refine-decode");
     td->refine_pose = getopt_get_bool(getopt, "refine-pose");
+    td->pyramid_levels = getopt_get_int(getopt, "pyramid");
 
     int quiet = getopt_get_bool(getopt, "quiet");
 
@@ -159,6 +161,13 @@ int main(int argc, char *argv[])
             if (!quiet) {
                 timeprofile_display(td->tp);
                 printf("nedges: %d, nsegments: %d, nquads: %d\n", td->nedges, td->nsegments, td->nquads);
+
+                int64_t busy[td->nthreads];
+                workerpool_get_busy_utime(td->wp, busy);
+                printf("thread busy (ms):");
+                for (int i = 0; i < td->nthreads; i++)
+                    printf(" %.3f", busy[i] / 1.0E3);
+                printf("\n");
             }
 
             if (!quiet)
@@ -34,9 +34,12 @@ either expressed or implied, of the FreeBSD Project.
 #include <string.h>
 #include <stdio.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "apriltag.h"
 #include "zarray.h"
-#include "zhash.h"
 #include "unionfind.h"
 #include "timeprofile.h"
 #include "zmaxheap.h"
@@ -45,16 +48,30 @@ either expressed or implied, of the FreeBSD Project.
 struct pt
 {
     uint16_t x, y;
-    float theta;
+};
+
+// a boundary point emitted during cluster construction, tagged with
+// the union-find representatives of the two components it
+// separates. rep0 is the representative of the smaller component.
+struct cluster_pt
+{
+    uint32_t rep0, rep1;
+    uint16_t x, y;
+};
+
+// a cluster is a contiguous span of points within one shared buffer.
+struct cluster
+{
+    struct pt *pts;
+    int sz;
 };
 
 struct quad_task
 {
-    zarray_t *clusters;
+    zarray_t *clusters; // struct cluster
     int cidx0, cidx1; // [cidx0, cidx1)
-    zarray_t *quads;
+    zarray_t *quads; // this task's output; concatenated in task order.
     apriltag_detector_t *td;
-    int w, h;
 
     image_u8_t *im;
 };
@@ -162,47 +179,36 @@ void fit_line(struct line_fit_pt *lfps, int sz, int i0, int i1, double *lineparm
 
     double nx, ny;
 
-    if (1) {
-        // on iOS about 5% of total CPU spent in these trig functions.
-        // 85 ms per frame on 5S, example.pnm
-        //
-        // XXX this was using the double-precision atan2. Was there a case where
-        // we needed that precision? Seems doubtful.
-        double normal_theta = .5 * atan2f(-2*Cxy, (Cyy - Cxx));
-        nx = cosf(normal_theta);
-        ny = sinf(normal_theta);
+    // The normal is at half the angle of (Cyy - Cxx, -2Cxy). Rather
+    // than atan2/cos/sin (formerly about 5% of total CPU on iOS), use
+    // the half angle formulas. This picks the same branch as
+    // .5*atan2(): nx >= 0, and ny has the sign of -2Cxy.
+    double ty = -2*Cxy;
+    double tx = (Cyy - Cxx);
+    double mag = ty*ty + tx*tx;
+
+    if (mag == 0) {
+        nx = 1;
+        ny = 0;
     } else {
-        // 73.5 ms per frame on 5S, example.pnm
-        double ty = -2*Cxy;
-        double tx = (Cyy - Cxx);
-        double mag = ty*ty + tx*tx;
+        // tx is now cos(2theta). We want sin(theta) and cos(theta)
+        tx /= sqrt(mag);
 
-        if (mag == 0) {
-            nx = 1;
+        // due to precision err, tx could still have slightly too large magnitude.
+        if (tx > 1) {
             ny = 0;
+            nx = 1;
+        } else if (tx < -1) {
+            ny = 1;
+            nx = 0;
         } else {
-            double norm = sqrtf(ty*ty + tx*tx);
-            tx /= norm;
-
-            // ty is now sin(2theta)
-            // tx is now cos(2theta). We want sin(theta) and cos(theta)
-
-            // due to precision err, tx could still have slightly too large magnitude.
-            if (tx > 1) {
-                ny = 0;
-                nx = 1;
-            } else if (tx < -1) {
-                ny = 1;
-                nx = 0;
-            } else {
-                // half angle formula
-                ny = sqrtf((1 - tx)/2);
-                nx = sqrtf((1 + tx)/2);
-
-                // pick a consistent branch cut
-                if (ty < 0)
-                    ny = - ny;
-            }
+            // half angle formula
+            ny = sqrt((1 - tx)/2);
+            nx = sqrt((1 + tx)/2);
+
+            // pick a consistent branch cut
+            if (ty < 0)
+                ny = - ny;
         }
     }
 
@@ -230,21 +236,48 @@ void fit_line(struct line_fit_pt *lfps, int sz, int i0, int i1, double *lineparm
         *mse = nx*nx*Cxx + 2*nx*ny*Cxy + ny*ny*Cyy;
 }
 
-int pt_compare_theta(const void *_a, const void *_b)
+// Partially sorts v[0..n-1] so that v[k] holds the value that would
+// be at index k if v were sorted descending. (Hoare's selection.)
+static double select_descending(double *v, int n, int k)
 {
-    struct pt *a = (struct pt*) _a;
-    struct pt *b = (struct pt*) _b;
+    int lo = 0, hi = n - 1;
+
+    while (lo < hi) {
+        double pivot = v[(lo + hi) / 2];
+        int i = lo, j = hi;
+
+        while (i <= j) {
+            while (v[i] > pivot)
+                i++;
+            while (v[j] < pivot)
+                j--;
+            if (i <= j) {
+                double t = v[i];
+                v[i] = v[j];
+                v[j] = t;
+                i++;
+                j--;
+            }
+        }
+
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
 
-    return (a->theta < b->theta) ? -1 : 1;
+    return v[k];
 }
 
-int err_compare_descending(const void *_a, const void *_b)
+// a line fit between two maxima, as used by quad_segment_maxima.
+struct segment_fit
 {
-    const double *a =  _a;
-    const double *b =  _b;
-
-    return ((*a) < (*b)) ? 1 : -1;
-}
+    double err;    // sum of squared errors, clamped at zero.
+    double nx, ny; // line normal
+    int ok;        // mse is within max_line_fit_mse
+};
 
 /*
 
@@ -262,10 +295,8 @@ int err_compare_descending(const void *_a, const void *_b)
   rather than pairs of clusters.) Critically, this helps keep nearby
   edges from becoming connected.
 */
-int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_fit_pt *lfps, int indices[4])
+int quad_segment_maxima(apriltag_detector_t *td, int sz, struct line_fit_pt *lfps, int indices[4])
 {
-    int sz = zarray_size(cluster);
-
     // ksz: when fitting points, how many points on either side do we consider?
     // (actual "kernel" width is 2ksz).
     //
@@ -284,49 +315,70 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
 
 //    printf("sz %5d, ksz %3d\n", sz, ksz);
 
-    double errs[sz];
+    // how much filter to apply to errs?
+    double sigma = 3;
 
-    for (int i = 0; i < sz; i++) {
-        fit_line(lfps, sz, (i + sz - ksz) % sz, (i + ksz) % sz, NULL, &errs[i], NULL);
-    }
+    // cutoff = exp(-j*j/(2*sigma*sigma));
+    // log(cutoff) = -j*j / (2*sigma*sigma)
+    // log(cutoff)*2*sigma*sigma = -j*j;
 
-    // apply a low-pass filter to errs
-    if (1) {
-        double y[sz];
+    // how big a filter should we use? We make our kernel big
+    // enough such that we represent any values larger than
+    // 'cutoff'.
+    double cutoff = 0.05;
+    int fsz = sqrt(-log(cutoff)*2*sigma*sigma) + 1;
+    fsz = 2*fsz + 1;
+    int fhalf = fsz / 2;
 
-        // how much filter to apply?
-        double sigma = 3;
+    // errs is stored with fhalf wrapped-around values padding either
+    // end, so that neither the filter nor the maxima search below
+    // needs modulo indexing. (ksz >= 2 implies sz >= 24 > fhalf.)
+    double errs_pad[sz + 2*fhalf];
+    double *errs = &errs_pad[fhalf];
 
-        // cutoff = exp(-j*j/(2*sigma*sigma));
-        // log(cutoff) = -j*j / (2*sigma*sigma)
-        // log(cutoff)*2*sigma*sigma = -j*j;
+    for (int i = 0; i < sz; i++) {
+        int i0 = i - ksz, i1 = i + ksz;
+        if (i0 < 0)
+            i0 += sz;
+        if (i1 >= sz)
+            i1 -= sz;
+
+        fit_line(lfps, sz, i0, i1, NULL, &errs[i], NULL);
+    }
 
-        // how big a filter should we use? We make our kernel big
-        // enough such that we represent any values larger than
-        // 'cutoff'.
-        double cutoff = 0.05;
-        int fsz = sqrt(-log(cutoff)*2*sigma*sigma) + 1;
-        fsz = 2*fsz + 1;
+    for (int i = 1; i <= fhalf; i++) {
+        errs[-i] = errs[sz - i];
+        errs[sz - 1 + i] = errs[i - 1];
+    }
 
+    // apply a low-pass filter to errs
+    if (1) {
         // For default values of cutoff = 0.05, sigma = 3,
         // we have fsz = 17.
         float f[fsz];
 
         for (int i = 0; i < fsz; i++) {
-            int j = i - fsz / 2;
+            int j = i - fhalf;
             f[i] = exp(-j*j/(2*sigma*sigma));
         }
 
+        double y[sz + 2];
+
         for (int iy = 0; iy < sz; iy++) {
             double acc = 0;
+            const double *e = &errs[iy - fhalf];
 
-            for (int i = 0; i < fsz; i++) {
-                acc += errs[(iy + i - fsz / 2 + sz) % sz] * f[i];
-            }
-            y[iy] = acc;
+            for (int i = 0; i < fsz; i++)
+                acc += e[i] * f[i];
+
+            y[iy + 1] = acc;
         }
 
-        memcpy(errs, y, sizeof(y));
+        // re-pad by one on each side for the maxima search.
+        y[0] = y[sz];
+        y[sz + 1] = y[1];
+
+        memcpy(&errs[-1], y, sizeof(y));
     }
 
     int maxima[sz];
@@ -334,7 +386,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
     int nmaxima = 0;
 
     for (int i = 0; i < sz; i++) {
-        if (errs[i] > errs[(i+1)%sz] && errs[i] > errs[(i+sz-1)%sz]) {
+        if (errs[i] > errs[i+1] && errs[i] > errs[i-1]) {
             maxima[nmaxima] = i;
             maxima_errs[nmaxima] = errs[i];
             nmaxima++;
@@ -352,10 +404,8 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
         double maxima_errs_copy[nmaxima];
         memcpy(maxima_errs_copy, maxima_errs, sizeof(maxima_errs_copy));
 
-        // throw out all but the best handful of maxima. Sorts descending.
-        qsort(maxima_errs_copy, nmaxima, sizeof(double), err_compare_descending);
-
-        double maxima_thresh = maxima_errs_copy[max_nmaxima];
+        // throw out all but the best handful of maxima.
+        double maxima_thresh = select_descending(maxima_errs_copy, nmaxima, max_nmaxima);
         int out = 0;
         for (int in = 0; in < nmaxima; in++) {
             if (maxima_errs[in] <= maxima_thresh)
@@ -363,65 +413,85 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
             maxima[out++] = maxima[in];
         }
         nmaxima = out;
+
+        if (nmaxima < 4)
+            return 0;
     }
 
-    int best_indices[4];
-    double best_error = HUGE;
+    // Fit each segment between a pair of maxima once. fits[a*n + b]
+    // is the segment from maxima[a] to maxima[b]; for a < b that runs
+    // forwards, for a > b it wraps around the end of the cluster. The
+    // search below only uses the wrapping fits with a >= b + 3.
+    int n = nmaxima;
+    struct segment_fit fits[n*n];
 
-    double err01, err12, err23, err30;
-    double mse01, mse12, mse23, mse30;
-    double params01[4], params12[4], params23[4], params30[4];
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++) {
+            if (a == b || (a > b && a < b + 3))
+                continue;
 
-    // disallow quads where the angle is less than a critical value.
-    double max_dot = cos(td->qtp.critical_rad); //25*M_PI/180);
+            struct segment_fit *sf = &fits[a*n + b];
+            double params[4], err, mse;
+
+            fit_line(lfps, sz, maxima[a], maxima[b], params, &err, &mse);
+
+            sf->err = err > 0 ? err : 0;
+            sf->nx = params[2];
+            sf->ny = params[3];
+            sf->ok = mse <= td->qtp.max_line_fit_mse;
+        }
+    }
 
-    for (int m0 = 0; m0 < nmaxima - 3; m0++) {
-        int i0 = maxima[m0];
+    int best_indices[4];
+    double best_error = HUGE_VAL;
 
-        for (int m1 = m0+1; m1 < nmaxima - 2; m1++) {
-            int i1 = maxima[m1];
+    // disallow quads where the angle is less than a critical value.
+    double max_dot = cos(td->qtp.critical_rad); //25*M_PI/180);
 
-            fit_line(lfps, sz, i0, i1, params01, &err01, &mse01);
+    // Since every err is non-negative, a partial sum that has already
+    // reached best_error cannot lead to a better quad.
+    for (int m0 = 0; m0 < n - 3; m0++) {
+        for (int m1 = m0+1; m1 < n - 2; m1++) {
+            const struct segment_fit *f01 = &fits[m0*n + m1];
 
-            if (mse01 > td->qtp.max_line_fit_mse)
+            if (!f01->ok || f01->err >= best_error)
                 continue;
 
-            for (int m2 = m1+1; m2 < nmaxima - 1; m2++) {
-                int i2 = maxima[m2];
+            for (int m2 = m1+1; m2 < n - 1; m2++) {
+                const struct segment_fit *f12 = &fits[m1*n + m2];
 
-                fit_line(lfps, sz, i1, i2, params12, &err12, &mse12);
-                if (mse12 > td->qtp.max_line_fit_mse)
+                if (!f12->ok)
                     continue;
 
-                double dot = params01[2]*params12[2] + params01[3]*params12[3];
-                if (fabs(dot) > max_dot)
+                double err012 = f01->err + f12->err;
+                if (err012 >= best_error)
                     continue;
 
-                for (int m3 = m2+1; m3 < nmaxima; m3++) {
-                    int i3 = maxima[m3];
+                double dot = f01->nx*f12->nx + f01->ny*f12->ny;
+                if (fabs(dot) > max_dot)
+                    continue;
 
-                    fit_line(lfps, sz, i2, i3, params23, &err23, &mse23);
-                    if (mse23 > td->qtp.max_line_fit_mse)
-                        continue;
+                for (int m3 = m2+1; m3 < n; m3++) {
+                    const struct segment_fit *f23 = &fits[m2*n + m3];
+                    const struct segment_fit *f30 = &fits[m3*n + m0];
 
-                    fit_line(lfps, sz, i3, i0, params30, &err30, &mse30);
-                    if (mse30 > td->qtp.max_line_fit_mse)
+                    if (!f23->ok || !f30->ok)
                         continue;
 
-                    double err = err01 + err12 + err23 + err30;
+                    double err = err012 + f23->err + f30->err;
                     if (err < best_error) {
                         best_error = err;
-                        best_indices[0] = i0;
-                        best_indices[1] = i1;
-                        best_indices[2] = i2;
-                        best_indices[3] = i3;
+                        best_indices[0] = maxima[m0];
+                        best_indices[1] = maxima[m1];
+                        best_indices[2] = maxima[m2];
+                        best_indices[3] = maxima[m3];
                     }
                 }
             }
         }
     }
 
-    if (best_error == HUGE)
+    if (best_error == HUGE_VAL)
         return 0;
 
     for (int i = 0; i < 4; i++)
@@ -433,10 +503,8 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
 }
 
 // returns 0 if the cluster looks bad.
-int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit_pt *lfps, int indices[4])
+int quad_segment_agg(apriltag_detector_t *td, int sz, struct line_fit_pt *lfps, int indices[4])
 {
-    int sz = zarray_size(cluster);
-
     zmaxheap_t *heap = zmaxheap_create(sizeof(struct remove_vertex*));
 
     // We will initially allocate sz rvs. We then have two types of
@@ -542,12 +610,110 @@ int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit
     return 1;
 }
 
+// A monotonic, integer stand-in for atan2(dy, dx) + PI: the octant
+// of (dx, dy), refined by the ratio of its smaller to its larger
+// component (scaled by 2^16). The result is in [0, 2^19), increasing
+// with angle, starting (like atan2) from the -x axis. The
+// conditionals below compile to conditional moves.
+static inline uint32_t pseudo_angle(int dx, int dy)
+{
+    const uint32_t S = 1 << 16;
+
+    uint32_t ax = abs(dx), ay = abs(dy);
+    uint32_t mn = ax < ay ? ax : ay;
+    uint32_t mx = ax < ay ? ay : ax;
+
+    // [0, S]; dx = dy = 0 maps to 0.
+    uint32_t r = (mn << 16) / (mx + (mx == 0));
+
+    // angle within the first quadrant, [0, 2S]
+    uint32_t a = ax >= ay ? r : 2*S - r;
+
+    // reflect into the proper quadrant, [0, 8S)
+    uint32_t q = dy >= 0 ? (dx >= 0 ? a : 4*S - a) : (dx < 0 ? 4*S + a : 8*S - a);
+
+    return (q + 4*S) & (8*S - 1);
+}
+
+// Sort points by angle around (cx, cy) and remove duplicates. Each
+// point is packed with its pseudo_angle into one 64-bit word (angle
+// in bits 32-50, x and y below), the words are LSD radix sorted on
+// the angle bits, and duplicates are dropped while unpacking. The
+// sort is stable. Returns the number of unique points.
+static int pts_sort_angle(struct pt *pts, int sz, int cx, int cy)
+{
+    uint64_t *keys = malloc(2 * sz * sizeof(uint64_t));
+    uint64_t *src = keys, *dst = &keys[sz];
+
+    for (int i = 0; i < sz; i++)
+        src[i] = ((uint64_t) pseudo_angle(pts[i].x - cx, pts[i].y - cy) << 32) |
+            ((uint32_t) pts[i].x << 16) | pts[i].y;
+
+    for (int shift = 32; shift < 51; shift += 8) {
+        int counts[256];
+        memset(counts, 0, sizeof(counts));
+
+        for (int i = 0; i < sz; i++)
+            counts[(src[i] >> shift) & 0xff]++;
+
+        // every point has the same digit; nothing to do.
+        if (counts[(src[0] >> shift) & 0xff] == sz)
+            continue;
+
+        int acc = 0;
+        for (int i = 0; i < 256; i++) {
+            int c = counts[i];
+            counts[i] = acc;
+            acc += c;
+        }
+
+        for (int i = 0; i < sz; i++)
+            dst[counts[(src[i] >> shift) & 0xff]++] = src[i];
+
+        uint64_t *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    // Duplicates share an angle, but several distinct points can
+    // share one too, so compare against every point already output
+    // with the current angle. (These runs are almost always 1 or 2
+    // points long.)
+    int outpos = 0, run0 = 0;
+
+    for (int i = 0; i < sz; i++) {
+        uint64_t k = src[i];
+
+        if (i > 0 && (k >> 32) != (src[i-1] >> 32))
+            run0 = outpos;
+
+        int dup = 0;
+        for (int j = run0; j < outpos && !dup; j++)
+            dup = (src[j] == k);
+
+        if (dup)
+            continue;
+
+        // safe in place: outpos <= i, and src[i-1] is only
+        // overwritten with itself.
+        src[outpos] = k;
+        pts[outpos].x = (k >> 16) & 0xffff;
+        pts[outpos].y = k & 0xffff;
+        outpos++;
+    }
+
+    free(keys);
+
+    return outpos;
+}
+
 // return 1 if the quad looks okay, 0 if it should be discarded
-int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct quad *quad)
+int fit_quad(apriltag_detector_t *td, image_u8_t *im, struct cluster *cluster, struct quad *quad)
 {
     int res = 0;
 
-    int sz = zarray_size(cluster);
+    struct pt *pts = cluster->pts;
+    int sz = cluster->sz;
     if (sz < 4) // can't fit a quad to less than 4 points
         return 0;
 
@@ -560,9 +726,8 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
     // according to their angle WRT the center.
     int xmax = 0, xmin = 9999999, ymax = 0, ymin = 9999999;
 
-    for (int pidx = 0; pidx < zarray_size(cluster); pidx++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, pidx, &p);
+    for (int pidx = 0; pidx < sz; pidx++) {
+        struct pt *p = &pts[pidx];
 
         xmax = imax(xmax, p->x);
         xmin = imin(xmin, p->x);
@@ -574,44 +739,10 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
     int cx = (xmin + xmax) / 2;
     int cy = (ymin + ymax) / 2;
 
-    for (int pidx = 0; pidx < zarray_size(cluster); pidx++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, pidx, &p);
-
-        p->theta = atan2f(p->y - cy, p->x - cx);
-    }
-
-    zarray_sort(cluster, pt_compare_theta);
-
-    // remove duplicate points. (A byproduct of our segmentation system.)
-    if (1) {
-        int outpos = 1;
-
-        struct pt *last;
-        zarray_get_volatile(cluster, 0, &last);
-
-        for (int i = 1; i < sz; i++) {
-
-            struct pt *p;
-            zarray_get_volatile(cluster, i, &p);
-
-            if (p->x != last->x || p->y != last->y) {
-
-                if (i != outpos)  {
-                    struct pt *out;
-                    zarray_get_volatile(cluster, outpos, &out);
-                    memcpy(out, p, sizeof(struct pt));
-                }
-
-                outpos++;
-            }
-
-            last = p;
-        }
-
-        cluster->size = outpos;
-        sz = outpos;
-    }
+    // this also removes duplicate points. (A byproduct of our
+    // segmentation system.)
+    sz = pts_sort_angle(pts, sz, cx, cy);
+    cluster->sz = sz;
 
     if (sz < 4)
         return 0;
@@ -623,8 +754,7 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
     struct line_fit_pt *lfps = calloc(sz, sizeof(struct line_fit_pt));
 
     for (int i = 0; i < sz; i++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, i, &p);
+        struct pt *p = &pts[i];
 
         if (i > 0) {
             memcpy(&lfps[i], &lfps[i-1], sizeof(struct line_fit_pt));
@@ -652,10 +782,10 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
 
     int indices[4];
     if (1) {
-        if (!quad_segment_maxima(td, cluster, lfps, indices))
+        if (!quad_segment_maxima(td, sz, lfps, indices))
             goto finish;
     } else {
-        if (!quad_segment_agg(td, cluster, lfps, indices))
+        if (!quad_segment_agg(td, sz, lfps, indices))
             goto finish;
     }
 
@@ -668,8 +798,7 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
         // plausibility checks that save us tons of time in quad
         // decoding.
         for (int i = 0; i < 4; i++) {
-            struct pt *p;
-            zarray_get_volatile(cluster, indices[i], &p);
+            struct pt *p = &pts[indices[i]];
 
             quad->p[i][0] = p->x;
             quad->p[i][1] = p->y;
@@ -706,6 +835,9 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
                 res = 0;
                 goto finish;
             }
+
+            if (err > quad->line_mse)
+                quad->line_mse = err;
         }
 
         for (int i = 0; i < 4; i++) {
@@ -827,8 +959,7 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
                 i1 += sz;
 
             for (int i = i0; i <= i1; i++) {
-                struct pt *p;
-                zarray_get_volatile(cluster, i % sz, &p);
+                struct pt *p = &pts[i % sz];
                 im->buf[((int) p->y)*im->stride + ((int) p->x)] = 64 + 128*(j%2);
             }
         }
@@ -851,36 +982,28 @@ static void do_quad_task(void *p)
     zarray_t *clusters = task->clusters;
     zarray_t *quads = task->quads;
     apriltag_detector_t *td = task->td;
-    int w = task->w, h = task->h;
 
     for (int cidx = task->cidx0; cidx < task->cidx1; cidx++) {
 
-        zarray_t *cluster;
-        zarray_get(clusters, cidx, &cluster);
-
-        if (zarray_size(cluster) < td->qtp.min_cluster_pixels)
-            continue;
-
-        // a cluster should contain only boundary points around the
-        // tag. it cannot be bigger than the whole screen. (Reject
-        // large connected blobs that will be prohibitively slow to
-        // fit quads to.)
-        if (zarray_size(cluster) > 4*(w+h)) {
-            continue;
-        }
+        struct cluster *cluster;
+        zarray_get_volatile(clusters, cidx, &cluster);
 
         struct quad quad;
         memset(&quad, 0, sizeof(struct quad));
 
-        if (fit_quad(td, task->im, cluster, &quad)) {
-            pthread_mutex_lock(&td->mutex);
+        if (fit_quad(td, task->im, cluster, &quad))
             zarray_add(quads, &quad);
-            pthread_mutex_unlock(&td->mutex);
-        }
     }
 }
 
-image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
+// The thresholding functions work on THRESH_TILESZ x THRESH_TILESZ
+// tiles, indexed tile_active[ty*tw + tx] where tw = w / THRESH_TILESZ
+// + 1. On entry, only tiles with non-zero tile_active are binarized
+// (the rest of the output is left 0); on return, tile_active says
+// which of those might contain edges.
+#define THRESH_TILESZ 16
+
+image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im, uint8_t *tile_active)
 {
     int w = im->width, h = im->height, s = im->stride;
 
@@ -904,7 +1027,7 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
     // The important thing is that the windows be large enough to
     // capture edge transitions; the tag does not need to fit into
     // a tile.
-    int tilesz = 16;
+    int tilesz = THRESH_TILESZ;
 
     int tw = w/tilesz + 1;
     int th = h/tilesz + 1;
@@ -912,11 +1035,23 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
     uint8_t *im_max = calloc(tw*th, sizeof(uint8_t));
     uint8_t *im_min = calloc(tw*th, sizeof(uint8_t));
 
-    // first, collect min/max statistics for each tile
+    // first, collect min/max statistics for each tile (that we will
+    // need)
     for (int ty = 0; ty < th; ty++) {
         for (int tx = 0; tx < tw; tx++) {
             uint8_t max = 0, min = 255;
 
+            int needed = 0;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    if (ty+dy >= 0 && ty+dy < th && tx+dx >= 0 && tx+dx < tw)
+                        needed |= tile_active[(ty+dy)*tw + tx+dx];
+                }
+            }
+
+            if (!needed)
+                continue;
+
             for (int dy = 0; dy < tilesz; dy++) {
                 if (ty*tilesz+dy >= h)
                     continue;
@@ -945,6 +1080,9 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
         for (int tx = 0; tx < tw; tx++) {
             uint8_t max = 0, min = 255;
 
+            if (!tile_active[ty*tw+tx])
+                continue;
+
             for (int dy = -1; dy <= 1; dy++) {
                 if (ty+dy < 0 || ty+dy >= th)
                     continue;
@@ -962,8 +1100,12 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
             }
 
             // XXX Tunable
-            if (max - min < td->qtp.min_white_black_diff)
+            if (max - min < td->qtp.min_white_black_diff) {
+                tile_active[ty*tw+tx] = 0;
                 continue;
+            }
+
+            tile_active[ty*tw+tx] = 1;
 
             // argument for biasing towards dark; specular highlights
             // can be substantially brighter than white tag parts
@@ -994,6 +1136,188 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
     return threshim;
 }
 
+// sum of the integral image ii (of an image of width w) over
+// [x0, x1) x [y0, y1).
+static inline int32_t integral_sum(const uint32_t *ii, int w, int x0, int y0, int x1, int y1)
+{
+    int iw = w + 1;
+    return ii[y1*iw + x1] - ii[y0*iw + x1] - ii[y1*iw + x0] + ii[y0*iw + x0];
+}
+
+// one pixel of threshold_mean, for use near the image border.
+static inline uint8_t threshold_mean_pixel(const uint32_t *ii, int w, int h, int r, int offset, int x, int y)
+{
+    int wx0 = imax(0, x - r), wx1 = imin(w, x + r + 1);
+    int wy0 = imax(0, y - r), wy1 = imin(h, y + r + 1);
+    int px0 = imax(0, x - 1), px1 = imin(w, x + 2);
+    int py0 = imax(0, y - 1), py1 = imin(h, y + 2);
+
+    int aw = (wx1 - wx0) * (wy1 - wy0);
+    int a3 = (px1 - px0) * (py1 - py0);
+
+    int32_t sw = integral_sum(ii, w, wx0, wy0, wx1, wy1);
+    int32_t s3 = integral_sum(ii, w, px0, py0, px1, py1);
+
+    // a pixel is white if
+    //    s3 / a3 > sw / aw - offset
+    // where s and a are the sums and areas of its 3x3 and window
+    // neighborhoods. In integers:
+    return s3*aw + offset*a3*aw > sw*a3;
+}
+
+// threshold_mean's output for pixels [xa, xb) of row y.
+static void threshold_mean_span(const uint32_t *ii, int w, int h, int r, int offset,
+                                int y, int xa, int xb, uint8_t *out)
+{
+    int iw = w + 1;
+
+    // [x0, x1) is handled by the vector loop.
+    int x0 = xa, x1 = xa;
+
+#ifdef __SSE2__
+    // away from the image border, the window areas are constant
+    // along the row, and we can do four pixels at a time.
+    if (y >= r && y + r < h) {
+        int wy0 = y - r, wy1 = y + r + 1;
+        int py0 = y - 1, py1 = y + 2;
+        int aw = (2*r + 1) * (2*r + 1);
+
+        // lanes hold (aw, 0) as 16 bit pairs, so that madd
+        // computes a 32 bit product.
+        const __m128i vaw = _mm_set1_epi32(aw);
+        const __m128i voff = _mm_set1_epi32(offset*9*aw);
+        const __m128i one = _mm_set1_epi8(1);
+
+        x0 = imax(xa, r);
+        for (x1 = x0; x1 + 4 <= imin(xb, w - r); x1 += 4) {
+            int x = x1;
+
+            __m128i sw = _mm_sub_epi32(
+                _mm_add_epi32(_mm_loadu_si128((__m128i*) &ii[wy1*iw + x + r + 1]),
+                              _mm_loadu_si128((__m128i*) &ii[wy0*iw + x - r])),
+                _mm_add_epi32(_mm_loadu_si128((__m128i*) &ii[wy0*iw + x + r + 1]),
+                              _mm_loadu_si128((__m128i*) &ii[wy1*iw + x - r])));
+
+            __m128i s3 = _mm_sub_epi32(
+                _mm_add_epi32(_mm_loadu_si128((__m128i*) &ii[py1*iw + x + 2]),
+                              _mm_loadu_si128((__m128i*) &ii[py0*iw + x - 1])),
+                _mm_add_epi32(_mm_loadu_si128((__m128i*) &ii[py0*iw + x + 2]),
+                              _mm_loadu_si128((__m128i*) &ii[py1*iw + x - 1])));
+
+            // see threshold_mean_pixel
+            __m128i lhs = _mm_add_epi32(_mm_madd_epi16(s3, vaw), voff);
+            __m128i rhs = _mm_add_epi32(_mm_slli_epi32(sw, 3), sw);
+
+            __m128i white = _mm_cmpgt_epi32(lhs, rhs);
+            white = _mm_packs_epi32(white, white);
+            white = _mm_packs_epi16(white, white);
+            white = _mm_and_si128(white, one);
+
+            int32_t v = _mm_cvtsi128_si32(white);
+            memcpy(&out[x], &v, 4);
+        }
+
+        if (x1 == x0)
+            x0 = x1 = xa;
+    }
+#endif
+
+    for (int x = xa; x < x0; x++)
+        out[x] = threshold_mean_pixel(ii, w, h, r, offset, x, y);
+    for (int x = x1; x < xb; x++)
+        out[x] = threshold_mean_pixel(ii, w, h, r, offset, x, y);
+}
+
+// An alternative to threshold(): binarize each pixel against the mean
+// of the (2r+1)x(2r+1) window around it, where r = qtp.mean_radius.
+// Pixels are 1 if brighter than the window mean minus
+// qtp.mean_offset, so flat regions (including noise smaller than the
+// offset) come out uniformly 1. The pixel value is itself the mean of
+// its 3x3 neighborhood, which takes the place of a blur pass.
+//
+// Both means come from one integral image: ii[(y+1)*(w+1) + (x+1)] is
+// the sum of im over [0,x] x [0,y].
+image_u8_t *threshold_mean(apriltag_detector_t *td, image_u8_t *im, uint8_t *tile_active)
+{
+    int w = im->width, h = im->height, s = im->stride;
+
+    image_u8_t *threshim = image_u8_create(w, h);
+    assert(threshim->stride == s);
+
+    // keep window areas small enough that the comparisons below fit
+    // in 32 bits.
+    int r = imax(1, imin(50, td->qtp.mean_radius));
+    int offset = td->qtp.mean_offset;
+
+    int iw = w + 1;
+    uint32_t *ii = malloc((size_t) iw*(h + 1)*sizeof(uint32_t));
+    memset(ii, 0, iw*sizeof(uint32_t));
+
+    for (int y = 0; y < h; y++) {
+        uint32_t *prev = &ii[y*iw], *row = &ii[(y+1)*iw];
+        const uint8_t *src = &im->buf[y*s];
+
+        uint32_t acc = 0;
+        row[0] = 0;
+        for (int x = 0; x < w; x++) {
+            acc += src[x];
+            row[x+1] = acc;
+        }
+
+        int x = 1;
+#ifdef __SSE2__
+        for (; x + 4 <= iw; x += 4) {
+            __m128i a = _mm_loadu_si128((__m128i*) &row[x]);
+            __m128i b = _mm_loadu_si128((__m128i*) &prev[x]);
+            _mm_storeu_si128((__m128i*) &row[x], _mm_add_epi32(a, b));
+        }
+#endif
+        for (; x < iw; x++)
+            row[x] += prev[x];
+    }
+
+    int tw = w / THRESH_TILESZ + 1, th = h / THRESH_TILESZ + 1;
+    uint8_t *requested = malloc(tw*th);
+    memcpy(requested, tile_active, tw*th);
+
+    for (int y = 0; y < h; y++) {
+        uint8_t *out = &threshim->buf[y*s];
+        const uint8_t *req = &requested[(y / THRESH_TILESZ) * tw];
+
+        // flat areas come out all white; a tile is active if it has
+        // any black pixels.
+        uint8_t *active = &tile_active[(y / THRESH_TILESZ) * tw];
+
+        if (y % THRESH_TILESZ == 0)
+            memset(active, 0, tw);
+
+        for (int tx = 0; tx*THRESH_TILESZ < w; ) {
+            if (!req[tx]) {
+                tx++;
+                continue;
+            }
+
+            int tx1 = tx + 1;
+            while (tx1*THRESH_TILESZ < w && req[tx1])
+                tx1++;
+
+            threshold_mean_span(ii, w, h, r, offset, y, tx*THRESH_TILESZ, imin(w, tx1*THRESH_TILESZ), out);
+
+            for (; tx < tx1; tx++) {
+                if (!active[tx])
+                    active[tx] = memchr(&out[tx*THRESH_TILESZ], 0, imin(THRESH_TILESZ, w - tx*THRESH_TILESZ)) != NULL;
+            }
+        }
+    }
+
+    free(requested);
+    free(ii);
+
+    timeprofile_stamp(td->tp, "threshold");
+
+    return threshim;
+}
+
 // basically the same as threshold(), but assumes the input image is a
 // bayer image. It collects statistics separately for each 2x2 block
 // of pixels.
@@ -1113,16 +1437,371 @@ image_u8_t *threshold_bayer(apriltag_detector_t *td, image_u8_t *im)
     return threshim;
 }
 
-zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
+// Stable LSD radix sort of n points on rep1 (which is < maxrep), 8
+// bits per pass. tmp must have room for n points.
+static void cluster_pts_sort_rep1(struct cluster_pt *cpts, struct cluster_pt *tmp, int n, uint32_t maxrep)
+{
+    struct cluster_pt *src = cpts, *dst = tmp;
+
+    for (int shift = 0; shift < 32 && (maxrep >> shift) != 0; shift += 8) {
+        int counts[256];
+        memset(counts, 0, sizeof(counts));
+
+        for (int i = 0; i < n; i++)
+            counts[(src[i].rep1 >> shift) & 0xff]++;
+
+        int acc = 0;
+        for (int i = 0; i < 256; i++) {
+            int c = counts[i];
+            counts[i] = acc;
+            acc += c;
+        }
+
+        for (int i = 0; i < n; i++)
+            dst[counts[(src[i].rep1 >> shift) & 0xff]++] = src[i];
+
+        struct cluster_pt *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != cpts)
+        memcpy(cpts, src, n * sizeof(struct cluster_pt));
+}
+
+// out = in, dilated by one tile in every direction.
+static void tiles_dilate(const uint8_t *in, uint8_t *out, int tw, int th)
+{
+    memset(out, 0, tw*th);
+
+    for (int ty = 0; ty < th; ty++) {
+        for (int tx = 0; tx < tw; tx++) {
+            if (!in[ty*tw+tx])
+                continue;
+
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    if (ty+dy >= 0 && ty+dy < th && tx+dx >= 0 && tx+dx < tw)
+                        out[(ty+dy)*tw + tx+dx] = 1;
+                }
+            }
+        }
+    }
+}
+
+// merge adjacent selected tiles into spans, one list per tile row:
+// spans[ty*(tw+1)*2 ...] lists the [x0, x1) column ranges to visit,
+// clamped to [1, w-1) and terminated by -1.
+static void tiles_to_spans(const uint8_t *tiles, int tw, int th, int w, int *spans_out)
+{
+    for (int ty = 0; ty < th; ty++) {
+        int *spans = &spans_out[ty*(tw+1)*2];
+        int n = 0;
+
+        for (int tx = 0; tx < tw; tx++) {
+            if (!tiles[ty*tw+tx])
+                continue;
+
+            int x0 = imax(1, tx*THRESH_TILESZ);
+            int x1 = imin(w - 1, (tx+1)*THRESH_TILESZ);
+            if (x0 >= x1)
+                continue;
+
+            if (n > 0 && spans[2*n-1] == x0)
+                spans[2*n-1] = x1;
+            else {
+                spans[2*n] = x0;
+                spans[2*n+1] = x1;
+                n++;
+            }
+        }
+
+        spans[2*n] = -1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+// Incremental detection (td->incremental).
+//
+// For every tile, ref holds the image as of the last time the tile
+// was searched. A tile has changed once its mean absolute difference
+// from ref exceeds td->change_threshold. Changes inside a tile can
+// move the threshold of its neighbors (threshold() looks at 3x3
+// tiles), and the edges of a cluster can run a bit further, so we
+// search QUAD_CACHE_MARGIN tiles around every changed tile. A
+// previous quad is reused only if neither it nor the tiles around it
+// are searched again; otherwise its tiles are searched too.
+//
+// Drift too slow to trip the threshold in one frame still
+// accumulates against ref, and every td->refresh_interval frames
+// the whole image is searched regardless.
+
+// XXX Tunable
+#define QUAD_CACHE_MARGIN 2
+
+struct apriltag_quad_cache
+{
+    int width, height;
+    uint8_t *ref;      // width*height
+    zarray_t *quads;   // struct quad; previous frame, H and Hinv NULL
+    int frames;        // since the last full search
+};
+
+void apriltag_quad_cache_destroy(struct apriltag_quad_cache *qc)
+{
+    if (qc == NULL)
+        return;
+
+    free(qc->ref);
+    zarray_destroy(qc->quads);
+    free(qc);
+}
+
+// sum of absolute differences over a tile, stopping once it exceeds
+// maxsad.
+static uint32_t tile_sad(const uint8_t *a, int as, const uint8_t *b, int bs,
+                         int tilew, int tileh, uint32_t maxsad)
+{
+    uint32_t sad = 0;
+
+    for (int y = 0; y < tileh && sad <= maxsad; y++) {
+        const uint8_t *pa = &a[y*as], *pb = &b[y*bs];
+
+#ifdef __SSE2__
+        if (tilew == 16) {
+            __m128i d = _mm_sad_epu8(_mm_loadu_si128((const __m128i*) pa),
+                                     _mm_loadu_si128((const __m128i*) pb));
+            sad += _mm_cvtsi128_si32(d) + _mm_extract_epi16(d, 4);
+            continue;
+        }
+#endif
+        for (int x = 0; x < tilew; x++)
+            sad += abs(pa[x] - pb[x]);
+    }
+
+    return sad;
+}
+
+// decide which tiles of im to search (search_tiles), and which of the
+// previous frame's quads are still good (appended to kept_quads).
+static void quad_cache_begin(apriltag_detector_t *td, image_u8_t *im,
+                             uint8_t *search_tiles, zarray_t *kept_quads)
+{
+    int w = im->width, h = im->height, s = im->stride;
+    int tw = w / THRESH_TILESZ + 1, th = h / THRESH_TILESZ + 1;
+
+    struct apriltag_quad_cache *qc = td->quad_cache;
+
+    if (qc == NULL || qc->width != w || qc->height != h ||
+        (td->refresh_interval > 0 && qc->frames + 1 >= td->refresh_interval)) {
+
+        if (qc == NULL || qc->width != w || qc->height != h) {
+            apriltag_quad_cache_destroy(qc);
+            qc = calloc(1, sizeof(struct apriltag_quad_cache));
+            qc->width = w;
+            qc->height = h;
+            qc->ref = malloc(w*h);
+            qc->quads = zarray_create(sizeof(struct quad));
+            td->quad_cache = qc;
+        }
+
+        for (int y = 0; y < h; y++)
+            memcpy(&qc->ref[y*w], &im->buf[y*s], w);
+
+        zarray_clear(qc->quads);
+        qc->frames = 0;
+        memset(search_tiles, 1, tw*th);
+        return;
+    }
+
+    qc->frames++;
+
+    uint8_t *changed = calloc(tw*th, sizeof(uint8_t));
+
+    for (int ty = 0; ty < th; ty++) {
+        for (int tx = 0; tx < tw; tx++) {
+            int x0 = tx*THRESH_TILESZ, y0 = ty*THRESH_TILESZ;
+            int tilew = imin(THRESH_TILESZ, w - x0), tileh = imin(THRESH_TILESZ, h - y0);
+            if (tilew <= 0 || tileh <= 0)
+                continue;
+
+            uint32_t maxsad = td->change_threshold * tilew * tileh;
+            changed[ty*tw+tx] = tile_sad(&im->buf[y0*s + x0], s, &qc->ref[y0*w + x0], w,
+                                         tilew, tileh, maxsad) > maxsad;
+        }
+    }
+
+    memcpy(search_tiles, changed, tw*th);
+    for (int i = 0; i < QUAD_CACHE_MARGIN; i++) {
+        tiles_dilate(search_tiles, changed, tw, th);
+        memcpy(search_tiles, changed, tw*th);
+    }
+
+    // drop the quads that touch a searched tile, and search all of
+    // their tiles (plus one) instead. That can make other quads
+    // touch, so repeat until nothing changes.
+    int nquads = zarray_size(qc->quads);
+    uint8_t *dropped = calloc(imax(nquads, 1), sizeof(uint8_t));
+
+    for (int again = 1; again; ) {
+        again = 0;
+
+        for (int i = 0; i < nquads; i++) {
+            if (dropped[i])
+                continue;
+
+            struct quad *q;
+            zarray_get_volatile(qc->quads, i, &q);
+
+            float xmin = q->p[0][0], xmax = xmin, ymin = q->p[0][1], ymax = ymin;
+            for (int j = 1; j < 4; j++) {
+                xmin = fminf(xmin, q->p[j][0]);
+                xmax = fmaxf(xmax, q->p[j][0]);
+                ymin = fminf(ymin, q->p[j][1]);
+                ymax = fmaxf(ymax, q->p[j][1]);
+            }
+
+            int tx0 = imax(0, (int) xmin / THRESH_TILESZ - 1);
+            int tx1 = imin(tw - 1, (int) xmax / THRESH_TILESZ + 1);
+            int ty0 = imax(0, (int) ymin / THRESH_TILESZ - 1);
+            int ty1 = imin(th - 1, (int) ymax / THRESH_TILESZ + 1);
+
+            int touches = 0;
+            for (int ty = ty0; ty <= ty1; ty++)
+                for (int tx = tx0; tx <= tx1; tx++)
+                    touches |= search_tiles[ty*tw+tx];
+
+            if (!touches)
+                continue;
+
+            dropped[i] = 1;
+            again = 1;
+
+            for (int ty = ty0; ty <= ty1; ty++)
+                for (int tx = tx0; tx <= tx1; tx++)
+                    search_tiles[ty*tw+tx] = 1;
+        }
+    }
+
+    for (int i = 0; i < nquads; i++) {
+        if (!dropped[i]) {
+            struct quad *q;
+            zarray_get_volatile(qc->quads, i, &q);
+            zarray_add(kept_quads, q);
+        }
+    }
+
+    // searched tiles start over from this frame.
+    for (int ty = 0; ty < th; ty++) {
+        for (int tx = 0; tx < tw; tx++) {
+            if (!search_tiles[ty*tw+tx])
+                continue;
+
+            int x0 = tx*THRESH_TILESZ, y0 = ty*THRESH_TILESZ;
+            int tilew = imin(THRESH_TILESZ, w - x0), tileh = imin(THRESH_TILESZ, h - y0);
+
+            for (int y = y0; y < y0 + tileh; y++)
+                memcpy(&qc->ref[y*w + x0], &im->buf[y*s + x0], imax(tilew, 0));
+        }
+    }
+
+    free(dropped);
+    free(changed);
+
+    timeprofile_stamp(td->tp, "tile changes");
+}
+
+// remember this frame's quads.
+static void quad_cache_end(apriltag_detector_t *td, zarray_t *quads)
+{
+    struct apriltag_quad_cache *qc = td->quad_cache;
+
+    zarray_clear(qc->quads);
+
+    for (int i = 0; i < zarray_size(quads); i++) {
+        struct quad q;
+        zarray_get(quads, i, &q);
+        q.H = NULL;
+        q.Hinv = NULL;
+        zarray_add(qc->quads, &q);
+    }
+}
+
+// The quad search. If small_size > 0, clusters whose bounding box is
+// smaller than small_size in both directions are not fit; instead,
+// their bounding boxes are appended to small_boxes (see
+// apriltag_quad_thresh_small).
+static zarray_t *quad_thresh_search(apriltag_detector_t *td, image_u8_t *im, int incremental,
+                                    int small_size, zarray_t *small_boxes)
 {
     ////////////////////////////////////////////////////////
     // step 1. threshold the image, creating the edge image.
 
     int w = im->width, h = im->height, s = im->stride;
 
-    image_u8_t *threshim = threshold(td, im);
+    int tw = w / THRESH_TILESZ + 1, th = h / THRESH_TILESZ + 1;
+
+    // search_tiles are the tiles we will look for quads in: all of
+    // them, unless we can reuse most of the previous frame's work
+    // (in which case kept_quads receives the reusable quads).
+    uint8_t *search_tiles = malloc(tw*th);
+    zarray_t *kept_quads = zarray_create(sizeof(struct quad));
+
+    if (incremental)
+        quad_cache_begin(td, im, search_tiles, kept_quads);
+    else
+        memset(search_tiles, 1, tw*th);
+
+    // the sums below look one pixel past the searched tiles, so we
+    // binarize one more tile around them.
+    uint8_t *thresh_tiles = malloc(tw*th);
+    tiles_dilate(search_tiles, thresh_tiles, tw, th);
+
+    uint8_t *tile_active = malloc(tw*th);
+    memcpy(tile_active, thresh_tiles, tw*th);
+
+    image_u8_t *threshim;
+    if (td->qtp.thresh_method == APRILTAG_THRESH_MEAN)
+        threshim = threshold_mean(td, im, tile_active);
+    else
+        threshim = threshold(td, im, tile_active);
     assert(threshim->stride == s);
 
+    if (!td->qtp.skip_flat_tiles)
+        memset(tile_active, 1, tw*th);
+
+    // Only tiles that are active, or next to an active one, can
+    // contain edge pixels: every other pixel's 3x3 neighborhood is
+    // uniform. The edge, union-find and cluster passes skip the rest
+    // (live_spans); their edgeim values stay 0, as a full pass would
+    // have left them.
+    //
+    // The sums are another matter: a flat tile's sumim is 0 if it is
+    // black, but 3 if it is white (which is what threshold_mean()
+    // makes of all flat areas), and the edge pass reads sumim one row
+    // above and below each live pixel. So sumim is computed on the
+    // ring of tiles around the live ones too (sum_spans). thresh_tiles
+    // contains that ring, so its threshim values are there to sum.
+    uint8_t *tile_live = malloc(tw*th);
+    tiles_dilate(tile_active, tile_live, tw, th);
+
+    int *sum_spans = malloc(th*(tw+1)*2*sizeof(int));
+    int *live_spans = malloc(th*(tw+1)*2*sizeof(int));
+
+    for (int i = 0; i < tw*th; i++)
+        search_tiles[i] &= tile_live[i];
+    tiles_to_spans(search_tiles, tw, th, w, live_spans);
+
+    tiles_dilate(search_tiles, tile_live, tw, th);
+    for (int i = 0; i < tw*th; i++)
+        thresh_tiles[i] &= tile_live[i];
+    tiles_to_spans(thresh_tiles, tw, th, w, sum_spans);
+
+    free(tile_live);
+    free(tile_active);
+    free(thresh_tiles);
+    free(search_tiles);
+
     image_u8_t *edgeim = image_u8_create(w, h);
 
     if (1) {
@@ -1130,12 +1809,16 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
         // apply a horizontal sum kernel of width 3
         for (int y = 0; y < h; y++) {
-            for (int x = 1; x+1 < w; x++) {
+            const int *spans = &sum_spans[(y / THRESH_TILESZ)*(tw+1)*2];
+
+            for (int i = 0; spans[i] >= 0; i += 2) {
+                for (int x = spans[i]; x < spans[i+1]; x++) {
 
-                sumim->buf[y*s + x] =
-                    threshim->buf[y*s + x - 1] +
-                    threshim->buf[y*s + x + 0] +
-                    threshim->buf[y*s + x + 1];
+                    sumim->buf[y*s + x] =
+                        threshim->buf[y*s + x - 1] +
+                        threshim->buf[y*s + x + 0] +
+                        threshim->buf[y*s + x + 1];
+                }
             }
         }
         timeprofile_stamp(td->tp, "sumim");
@@ -1143,23 +1826,27 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
         // deglitch
         if (td->qtp.deglitch) {
             for (int y = 1; y+1 < h; y++) {
-                for (int x = 1; x+1 < w; x++) {
-                    // edge: black pixel next to white pixel
-                    if (threshim->buf[y*s + x] == 0 &&
-                        sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] == 8) {
-                        threshim->buf[y*s + x] = 1;
-                        sumim->buf[y*s + x - 1]++;
-                        sumim->buf[y*s + x + 0]++;
-                        sumim->buf[y*s + x + 1]++;
+                const int *spans = &live_spans[(y / THRESH_TILESZ)*(tw+1)*2];
+
+                for (int i = 0; spans[i] >= 0; i += 2) {
+                    for (int x = spans[i]; x < spans[i+1]; x++) {
+                        // edge: black pixel next to white pixel
+                        if (threshim->buf[y*s + x] == 0 &&
+                            sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] == 8) {
+                            threshim->buf[y*s + x] = 1;
+                            sumim->buf[y*s + x - 1]++;
+                            sumim->buf[y*s + x + 0]++;
+                            sumim->buf[y*s + x + 1]++;
+                        }
+
+                        if (threshim->buf[y*s + x] == 1 &&
+                            sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] == 1) {
+                            threshim->buf[y*s + x] = 0;
+                            sumim->buf[y*s + x - 1]--;
+                            sumim->buf[y*s + x + 0]--;
+                            sumim->buf[y*s + x + 1]--;
+                       }
                     }
-
-                    if (threshim->buf[y*s + x] == 1 &&
-                        sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] == 1) {
-                        threshim->buf[y*s + x] = 0;
-                        sumim->buf[y*s + x - 1]--;
-                        sumim->buf[y*s + x + 0]--;
-                        sumim->buf[y*s + x + 1]--;
-                   }
                 }
             }
 
@@ -1193,17 +1880,21 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
         //
 
         for (int y = 1; y+1 < h; y++) {
-            for (int x = 1; x+1 < w; x++) {
-                if (threshim->buf[y*s + x] == 0) {
-                    // edge: black pixel next to white pixel
-                    if (sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] > 0)
-                        edgeim->buf[y*s + x] = 0xc0;
-                } else {
-                    // edge: white pixel next to black pixel when both
-                    // edge types are on, we get less bias towards one
-                    // side of the edge.
-                    if (sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] < 9)
-                        edgeim->buf[y*s + x] = 0x3f;
+            const int *spans = &live_spans[(y / THRESH_TILESZ)*(tw+1)*2];
+
+            for (int i = 0; spans[i] >= 0; i += 2) {
+                for (int x = spans[i]; x < spans[i+1]; x++) {
+                    if (threshim->buf[y*s + x] == 0) {
+                        // edge: black pixel next to white pixel
+                        if (sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] > 0)
+                            edgeim->buf[y*s + x] = 0xc0;
+                    } else {
+                        // edge: white pixel next to black pixel when both
+                        // edge types are on, we get less bias towards one
+                        // side of the edge.
+                        if (sumim->buf[y*s + x - s] + sumim->buf[y*s + x] + sumim->buf[y*s + x + s] < 9)
+                            edgeim->buf[y*s + x] = 0x3f;
+                    }
                 }
             }
         }
@@ -1229,25 +1920,38 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
     ////////////////////////////////////////////////////////
     // step 2. find connected components.
 
-    unionfind_t *uf = unionfind_create(w * h);
+    // edge pixels only occur in live spans, so those are the only
+    // ids we need to initialize.
+    unionfind_t *uf = unionfind_create_uninitialized(w * h);
 
     for (int y = 1; y < h - 1; y++) {
-        for (int x = 1; x < w -1; x++) {
-            uint8_t v = edgeim->buf[y*s + x];
-            if (v==0)
-                continue;
+        const int *spans = &live_spans[(y / THRESH_TILESZ)*(tw+1)*2];
 
-            // (dx,dy) pairs for 8 connectivity:
-            //          (REFERENCE) (1, 0)
-            // (-1, 1)    (0, 1)    (1, 1)
-            //
-            // i.e., the minimum value of dx should be:
-            //   y=0:   1
-            //   y=1:  -1
-            for (int dy = 0; dy <= 1; dy++) {
-                for (int dx = 1-2*dy; dx <= 1; dx++) {
-                    if (edgeim->buf[(y+dy)*s + (x+dx)] == v) {
-                        unionfind_connect(uf, y*w + x, (y+dy)*w + x + dx);
+        for (int i = 0; spans[i] >= 0; i += 2)
+            unionfind_init_range(uf, y*w + spans[i], y*w + spans[i+1]);
+    }
+
+    for (int y = 1; y < h - 1; y++) {
+        const int *spans = &live_spans[(y / THRESH_TILESZ)*(tw+1)*2];
+
+        for (int i = 0; spans[i] >= 0; i += 2) {
+            for (int x = spans[i]; x < spans[i+1]; x++) {
+                uint8_t v = edgeim->buf[y*s + x];
+                if (v==0)
+                    continue;
+
+                // (dx,dy) pairs for 8 connectivity:
+                //          (REFERENCE) (1, 0)
+                // (-1, 1)    (0, 1)    (1, 1)
+                //
+                // i.e., the minimum value of dx should be:
+                //   y=0:   1
+                //   y=1:  -1
+                for (int dy = 0; dy <= 1; dy++) {
+                    for (int dx = 1-2*dy; dx <= 1; dx++) {
+                        if (edgeim->buf[(y+dy)*s + (x+dx)] == v) {
+                            unionfind_connect(uf, y*w + x, (y+dy)*w + x + dx);
+                        }
                     }
                 }
             }
@@ -1256,60 +1960,169 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     timeprofile_stamp(td->tp, "unionfind");
 
-    zhash_t *clustermap = zhash_create(sizeof(uint64_t), sizeof(zarray_t*),
-                                       zhash_uint64_hash, zhash_uint64_equals);
+    // Every boundary pixel pair is emitted (twice: once for each side
+    // of the boundary) into one flat buffer, tagged with the pair of
+    // components it separates. A counting sort on the smaller
+    // component, followed by a sort on the larger one within each
+    // bucket, then yields each cluster as a contiguous run of points.
+    //
+    // Bucketing on the smaller component keeps buckets short: a
+    // small component borders only a few others, whereas a large
+    // background component can border thousands.
+    int ncpts = 0, cpts_alloc = 4096;
+    struct cluster_pt *cpts = malloc(cpts_alloc * sizeof(struct cluster_pt));
+    uint32_t *offsets = calloc(w*h, sizeof(uint32_t));
 
     for (int y = 1; y < h-1; y++) {
-        for (int x = 1; x < w-1; x++) {
+        const int *spans = &live_spans[(y / THRESH_TILESZ)*(tw+1)*2];
 
-            uint8_t v0 = edgeim->buf[y*s + x];
-            if (v0 == 0)
-                continue;
+        for (int i = 0; spans[i] >= 0; i += 2) {
+            for (int x = spans[i]; x < spans[i+1]; x++) {
 
-            uint64_t rep0 = unionfind_get_representative(uf, y*w + x);
+                uint8_t v0 = edgeim->buf[y*s + x];
+                if (v0 == 0)
+                    continue;
 
-            // 8 connectivity. (4 neighbors to check).
-//            for (int dy = 0; dy <= 1; dy++) {
-//                for (int dx = 1-2*dy; dx <= 1; dx++) {
+                uint32_t rep0 = unionfind_get_representative(uf, y*w + x);
 
-            // 4 connectivity. (2 neighbors to check)
-            for (int n = 1; n <= 2; n++) {
-                int dy = n & 1;
-                int dx = (n & 2) >> 1;
+                // 8 connectivity. (4 neighbors to check).
+    //            for (int dy = 0; dy <= 1; dy++) {
+    //                for (int dx = 1-2*dy; dx <= 1; dx++) {
 
-                uint8_t v1 = edgeim->buf[(y+dy)*s + x + dx];
-                if (v0 + v1 != 255)
-                    continue;
-                uint64_t rep1 = unionfind_get_representative(uf, (y+dy)*w + x+dx);
-
-                uint64_t clusterid;
-                if (rep0 < rep1)
-                    clusterid = (rep1 << 32) + rep0;
-                else
-                    clusterid = (rep0 << 32) + rep1;
-
-                zarray_t *cluster = NULL;
-                if (!zhash_get(clustermap, &clusterid, &cluster)) {
-                    cluster = zarray_create(sizeof(struct pt));
-                    zhash_put(clustermap, &clusterid, &cluster, NULL, NULL);
+                // 4 connectivity. (2 neighbors to check)
+                for (int n = 1; n <= 2; n++) {
+                    int dy = n & 1;
+                    int dx = (n & 2) >> 1;
+
+                    uint8_t v1 = edgeim->buf[(y+dy)*s + x + dx];
+                    if (v0 + v1 != 255)
+                        continue;
+                    uint32_t rep1 = unionfind_get_representative(uf, (y+dy)*w + x+dx);
+
+                    uint32_t sz0 = uf->data[rep0].size, sz1 = uf->data[rep1].size;
+
+                    struct cluster_pt cp;
+                    if (sz0 < sz1 || (sz0 == sz1 && rep0 < rep1)) {
+                        cp.rep0 = rep0;
+                        cp.rep1 = rep1;
+                    } else {
+                        cp.rep0 = rep1;
+                        cp.rep1 = rep0;
+                    }
+
+                    if (ncpts + 2 > cpts_alloc) {
+                        cpts_alloc *= 2;
+                        cpts = realloc(cpts, cpts_alloc * sizeof(struct cluster_pt));
+                    }
+
+                    // NB: We will add some points multiple times to a
+                    // given cluster.  I don't know an efficient way to
+                    // avoid that here; we remove them later on when we
+                    // sort points by pts_sort_angle.
+                    cp.x = x;
+                    cp.y = y;
+                    cpts[ncpts++] = cp;
+
+                    cp.x = x + dx;
+                    cp.y = y + dy;
+                    cpts[ncpts++] = cp;
+
+                    offsets[cp.rep0] += 2;
+                }
+            }
+        }
+    }
+
+    struct cluster_pt *sorted = malloc(imax(ncpts, 1) * sizeof(struct cluster_pt));
+
+    if (1) {
+        uint32_t acc = 0;
+        for (int i = 0; i < w*h; i++) {
+            uint32_t c = offsets[i];
+            offsets[i] = acc;
+            acc += c;
+        }
+
+        for (int i = 0; i < ncpts; i++)
+            sorted[offsets[cpts[i].rep0]++] = cpts[i];
+    }
+
+    free(offsets);
+    free(sum_spans);
+    free(live_spans);
+
+    // Materialize clusters as spans of a single point buffer. A
+    // cluster should contain only boundary points around the tag; it
+    // cannot be bigger than the whole screen. (Reject large connected
+    // blobs that will be prohibitively slow to fit quads to.) Tiny
+    // clusters are rejected too. Neither kind is ever copied.
+    struct pt *pts = malloc(imax(ncpts, 1) * sizeof(struct pt));
+    zarray_t *clusters = zarray_create(sizeof(struct cluster));
+
+    int npts = 0;
+    for (int i0 = 0; i0 < ncpts; ) {
+        int i1 = i0 + 1, uniform = 1;
+
+        while (i1 < ncpts && sorted[i1].rep0 == sorted[i0].rep0) {
+            uniform &= (sorted[i1].rep1 == sorted[i0].rep1);
+            i1++;
+        }
+
+        // this component borders more than one other; separate them.
+        // (cpts is no longer needed and serves as scratch space.)
+        if (!uniform)
+            cluster_pts_sort_rep1(&sorted[i0], cpts, i1 - i0, w*h);
+
+        for (int j0 = i0; j0 < i1; ) {
+            int j1 = j0 + 1;
+            while (j1 < i1 && sorted[j1].rep1 == sorted[j0].rep1)
+                j1++;
+
+            int n = j1 - j0;
+
+            if (small_size > 0 && n >= 4) {
+                int xmin = w, xmax = 0, ymin = h, ymax = 0;
+                for (int j = j0; j < j1; j++) {
+                    xmin = imin(xmin, sorted[j].x);
+                    xmax = imax(xmax, sorted[j].x);
+                    ymin = imin(ymin, sorted[j].y);
+                    ymax = imax(ymax, sorted[j].y);
                 }
 
-                // NB: We will add some points multiple times to a
-                // given cluster.  I don't know an efficient way to
-                // avoid that here; we remove them later on when we
-                // sort points by pt_compare_theta.
-                if (1) {
-                    struct pt p = { .x = x, .y = y};
-                    zarray_add(cluster, &p);
+                if (xmax - xmin < small_size && ymax - ymin < small_size) {
+                    // XXX Tunable: anything smaller than this is
+                    // noise, even at twice the resolution.
+                    if (xmax - xmin >= 2 && ymax - ymin >= 2) {
+                        int box[4] = { xmin, ymin, xmax, ymax };
+                        zarray_add(small_boxes, box);
+                    }
+
+                    j0 = j1;
+                    continue;
                 }
-                if (1) {
-                    struct pt p = { .x = x+dx, .y = y+dy};
-                    zarray_add(cluster, &p);
+            }
+
+            if (n >= td->qtp.min_cluster_pixels && n <= 4*(w+h)) {
+                struct cluster cluster = { .pts = &pts[npts], .sz = n };
+
+                for (int j = j0; j < j1; j++) {
+                    pts[npts].x = sorted[j].x;
+                    pts[npts].y = sorted[j].y;
+                    npts++;
                 }
+
+                zarray_add(clusters, &cluster);
             }
+
+            j0 = j1;
         }
+
+        i0 = i1;
     }
 
+    free(sorted);
+    free(cpts);
+
     // make segmentation image.
     if (td->debug) {
         image_u8_t *d = image_u8_create(w, h);
@@ -1319,6 +2132,10 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
         for (int y = 0; y < h; y++) {
             for (int x = 0; x < w; x++) {
+                // only edge pixels have been initialized in uf.
+                if (edgeim->buf[y*s + x] == 0)
+                    continue;
+
                 uint32_t v = unionfind_get_representative(uf, y*w+x);
                 uint32_t sz = unionfind_get_set_size(uf, y*w+x);
                 if (sz < td->qtp.min_cluster_pixels)
@@ -1350,32 +2167,60 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
     ////////////////////////////////////////////////////////
     // step 3. process each connected component.
 
-    zarray_t *clusters = zhash_values(clustermap);
-    zhash_destroy(clustermap);
-
     zarray_t *quads = zarray_create(sizeof(struct quad));
 
+    // fit_quad's cost grows with the size of the cluster, and one
+    // cluster can be 100x the median, so balance the tasks by
+    // point count rather than by number of clusters.
     int sz = zarray_size(clusters);
-    int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-    struct quad_task tasks[sz / chunksize + 1];
-
-    int ntasks = 0;
-    for (int i = 0; i < sz; i += chunksize) {
-        tasks[ntasks].td = td;
-        tasks[ntasks].cidx0 = i;
-        tasks[ntasks].cidx1 = imin(sz, i + chunksize);
-        tasks[ntasks].h = h;
-        tasks[ntasks].w = w;
-        tasks[ntasks].quads = quads;
-        tasks[ntasks].clusters = clusters;
-        tasks[ntasks].im = im;
-
-        workerpool_add_task(td->wp, do_quad_task, &tasks[ntasks]);
-        ntasks++;
+    double *costs = malloc(sizeof(double) * (sz + 1));
+    int *bounds = malloc(sizeof(int) * (sz + 1));
+
+    for (int i = 0; i < sz; i++) {
+        struct cluster *cluster;
+        zarray_get_volatile(clusters, i, &cluster);
+        costs[i] = cluster->sz;
+    }
+
+    int ntasks = workerpool_partition(costs, sz, APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads, bounds);
+    struct quad_task *tasks = malloc(sizeof(struct quad_task) * (ntasks + 1));
+
+    for (int i = 0; i < ntasks; i++) {
+        tasks[i].td = td;
+        tasks[i].cidx0 = bounds[i];
+        tasks[i].cidx1 = bounds[i+1];
+        tasks[i].quads = zarray_create(sizeof(struct quad));
+        tasks[i].clusters = clusters;
+        tasks[i].im = im;
+
+        double cost = 0;
+        for (int j = bounds[i]; j < bounds[i+1]; j++)
+            cost += costs[j];
+
+        workerpool_add_task_cost(td->wp, do_quad_task, &tasks[i], cost);
     }
 
     workerpool_run(td->wp);
 
+    // gather results in task order so that the output doesn't depend
+    // on thread timing.
+    for (int i = 0; i < ntasks; i++) {
+        zarray_add_all(quads, tasks[i].quads);
+        zarray_destroy(tasks[i].quads);
+    }
+
+    free(tasks);
+    free(bounds);
+    free(costs);
+
+    // quads from unchanged parts of the image come last. Remember
+    // this frame's quads for the next one.
+    zarray_add_all(quads, kept_quads);
+    zarray_destroy(kept_quads);
+
+    if (incremental)
+        quad_cache_end(td, quads);
+
     timeprofile_stamp(td->tp, "fit quads to clusters");
 
     if (td->debug) {
@@ -1438,15 +2283,27 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     unionfind_destroy(uf);
 
-    for (int i = 0; i < zarray_size(clusters); i++) {
-        zarray_t *cluster;
-        zarray_get(clusters, i, &cluster);
-        zarray_destroy(cluster);
-    }
-
     zarray_destroy(clusters);
+    free(pts);
 
     image_u8_destroy(edgeim);
 
     return quads;
 }
+
+zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
+{
+    return quad_thresh_search(td, im, td->incremental, 0, NULL);
+}
+
+// Used by the image pyramid: like apriltag_quad_thresh, but clusters
+// whose bounding box is smaller than small_size pixels on both sides
+// are not fit to quads. Their bounding boxes are appended to
+// small_boxes instead, as four ints (xmin, ymin, xmax, ymax;
+// inclusive), so that they can be searched again at a higher
+// resolution. Never incremental.
+zarray_t *apriltag_quad_thresh_small(apriltag_detector_t *td, image_u8_t *im,
+                                     int small_size, zarray_t *small_boxes)
+{
+    return quad_thresh_search(td, im, 0, small_size, small_boxes);
+}
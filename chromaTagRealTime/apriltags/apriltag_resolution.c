@@ -0,0 +1,154 @@
+/* (C) 2013-2014, The Regents of The University of Michigan
+All rights reserved.
+
+This software may be available under alternative licensing
+terms. Contact Edwin Olson, ebolson@umich.edu, for more information.
+
+   Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "apriltag_resolution.h"
+#include "common/math_util.h"
+#include "common/zarray.h"
+
+// decimation factors that image_u8_decimate has fast paths for.
+static const float decimations[] = { 1, 1.5, 2, 3, 4 };
+#define NDECIMATIONS (sizeof(decimations) / sizeof(decimations[0]))
+
+apriltag_resolution_t *apriltag_resolution_create(double budget_ms)
+{
+    apriltag_resolution_t *rc = calloc(1, sizeof(apriltag_resolution_t));
+
+    rc->budget_ms = budget_ms;
+
+    // XXX Tunable. A 36h11 tag is 10 cells across its black border
+    // (with black_border = 1); decoding wants about 3 pixels per
+    // cell, and a quad can still be fit at about one.
+    rc->min_decode_side = 30;
+    rc->min_quad_side = 12;
+    rc->margin = 1.5;
+
+    rc->min_scale = 0.25;
+    rc->scale_steps = 16;
+
+    rc->scale = 1;
+    rc->quad_decimate = 1;
+    rc->resolution = 1;
+
+    return rc;
+}
+
+void apriltag_resolution_destroy(apriltag_resolution_t *rc)
+{
+    free(rc);
+}
+
+void apriltag_resolution_update(apriltag_resolution_t *rc, apriltag_tracker_t *tt,
+                                double frame_scale, double frame_ms)
+{
+    int ntracks = zarray_size(tt->tracks);
+    int missed = 0;
+    double side = HUGE_VAL;
+
+    for (int i = 0; i < ntracks; i++) {
+        apriltag_track_t *t;
+        zarray_get_volatile(tt->tracks, i, &t);
+
+        if (t->missed) {
+            missed = 1;
+            continue;
+        }
+
+        for (int k = 0; k < 4; k++) {
+            double dx = t->p[(k+1)&3][0] - t->p[k][0];
+            double dy = t->p[(k+1)&3][1] - t->p[k][1];
+            side = fmin(side, sqrt(dx*dx + dy*dy) / frame_scale);
+        }
+    }
+
+    double res = rc->resolution;
+    double res_floor = 0, scale_floor = 0;
+
+    if (ntracks == 0) {
+        res = 1;
+        rc->min_side = 0;
+    } else if (missed || side == HUGE_VAL) {
+        // back off quickly; keep the last size we knew.
+        res = fmin(1, 2*res);
+    } else {
+        rc->min_side = side;
+
+        // cost goes with the square of the resolution. (XXX Tunable
+        // dead band, so we don't chase noise.)
+        if (frame_ms > rc->budget_ms)
+            res *= fmax(0.5, sqrt(rc->budget_ms / frame_ms));
+        else if (frame_ms < 0.7 * rc->budget_ms)
+            res *= fmin(1.25, sqrt(rc->budget_ms / frame_ms));
+
+        res_floor = rc->min_quad_side * rc->margin / side;
+        res = fmax(res, res_floor);
+    }
+
+    res = fmin(1, fmax(res, rc->min_scale / decimations[NDECIMATIONS - 1]));
+    rc->resolution = res;
+
+    // prefer smaller frames (cheaper to convert and decode) down to
+    // what decoding the smallest tag needs; decimate beyond that.
+    double scale = res;
+    if (rc->min_side > 0) {
+        scale_floor = rc->min_decode_side * rc->margin / rc->min_side;
+        scale = fmax(scale, scale_floor);
+    }
+    scale = fmax(scale, rc->min_scale);
+    scale = fmin(1, ceil(scale * rc->scale_steps) / rc->scale_steps);
+
+    float decimate = 1;
+    for (int i = 0; i < NDECIMATIONS; i++) {
+        if (scale / decimations[i] >= res * (1 - 1e-6))
+            decimate = decimations[i];
+    }
+
+    // scale and decimation come in steps, so a small increase in
+    // resolution can be a large one in cost. Don't take a step up
+    // that we expect to blow the budget, unless backing off or the
+    // smallest tag needs it.
+    double current = frame_scale / tt->td->quad_decimate;
+    double next = scale / decimate;
+
+    if (ntracks > 0 && !missed && next > current &&
+        current >= res_floor && frame_scale >= scale_floor &&
+        frame_ms * sq(next / current) > rc->budget_ms) {
+        scale = frame_scale;
+        decimate = tt->td->quad_decimate;
+        rc->resolution = current;
+    }
+
+    rc->scale = scale;
+    rc->quad_decimate = decimate;
+    tt->td->quad_decimate = decimate;
+}
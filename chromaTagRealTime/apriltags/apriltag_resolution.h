@@ -0,0 +1,125 @@
+/* (C) 2013-2014, The Regents of The University of Michigan
+All rights reserved.
+
+This software may be available under alternative licensing
+terms. Contact Edwin Olson, ebolson@umich.edu, for more information.
+
+   Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+ */
+
+#ifndef _APRILTAG_RESOLUTION_H
+#define _APRILTAG_RESOLUTION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "apriltag_tracker.h"
+
+// Chooses, frame by frame, how much resolution to spend on tracked
+// tags: the scale the caller should resize its frames by before
+// detection, and the quad_decimate of the tracker's detector.
+//
+// The smallest tracked tag sets a floor: it must stay at least
+// min_decode_side pixels across in the scaled frame (so it can be
+// decoded) and min_quad_side pixels in the decimated one (so its quad
+// can be found), both times margin. Above that floor the controller
+// steers toward budget_ms per frame: it lowers the resolution when
+// frames take longer, and raises it again when there is time to
+// spare. Cost is taken to be proportional to the number of pixels.
+//
+// When a tracked tag is missed the resolution is doubled (up to
+// full) on the next frame, and with no tracks at all it goes to full
+// resolution so that the discovery search can find small tags.
+//
+// Frame scales are quantized to 1/scale_steps, so that a jittery
+// measurement doesn't resize every frame.
+
+typedef struct apriltag_resolution apriltag_resolution_t;
+struct apriltag_resolution
+{
+    ///////////////////////////////////////////////////////////////
+    // User-configurable parameters.
+
+    double budget_ms;
+
+    double min_decode_side;
+    double min_quad_side;
+    double margin;
+
+    double min_scale;
+    int scale_steps;
+
+    ///////////////////////////////////////////////////////////////
+    // Outputs, for the next frame.
+
+    // resize frames by this factor (<= 1) before detection.
+    double scale;
+
+    // also written to the tracker's detector by update().
+    float quad_decimate;
+
+    ///////////////////////////////////////////////////////////////
+    // State
+
+    // linear resolution at which quads are searched for, relative
+    // to the full frame: scale / quad_decimate.
+    double resolution;
+
+    // side of the smallest tracked tag, in full-frame pixels, as of
+    // the last update (0 when there are no tracks).
+    double min_side;
+};
+
+apriltag_resolution_t *apriltag_resolution_create(double budget_ms);
+void apriltag_resolution_destroy(apriltag_resolution_t *rc);
+
+// Call after each apriltag_tracker_update: frame_scale is the scale
+// that frame was resized by, and frame_ms how long it took (e.g.,
+// timeprofile_total_utime(td->tp) / 1.0E3, plus the caller's own
+// conversion time). Updates scale and quad_decimate (including
+// tt->td->quad_decimate) for the next frame.
+//
+// Tracks are kept in the coordinates of the frames they come from,
+// so the caller must apriltag_tracker_rescale(tt, new / old) before
+// passing the tracker a frame at a different scale.
+//
+// Sets the quad_decimate of the tracker's detector, so it is not for
+// trackers that share a detector (through contexts).
+//
+// The frame is taken to have been detected at tt->td->quad_decimate.
+// A caller that queues frames already resized (a pipeline) should
+// keep quad_decimate with each frame's scale and set
+// td->quad_decimate from it before detecting that frame; otherwise
+// frames resized at the old scale are detected at the new
+// decimation, a resolution the controller never chose.
+void apriltag_resolution_update(apriltag_resolution_t *rc, apriltag_tracker_t *tt,
+                                double frame_scale, double frame_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
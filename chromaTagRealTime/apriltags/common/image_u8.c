@@ -338,7 +338,7 @@ image_u8_t *image_u8_rotate(const image_u8_t *in, double rad, uint8_t pad)
 
     float p[][2] = { { 0, 0}, { iwidth, 0 }, { iwidth, iheight }, { 0, iheight} };
 
-    float xmin = HUGE, xmax = -HUGE, ymin = HUGE, ymax = -HUGE;
+    float xmin = HUGE_VAL, xmax = -HUGE_VAL, ymin = HUGE_VAL, ymax = -HUGE_VAL;
     float icx = iwidth / 2.0, icy = iheight / 2.0;
 
     for (int i = 0; i < 4; i++) {
@@ -466,6 +466,192 @@ void neon_decimate4(uint8_t * __restrict dest, int destwidth, int destheight, in
 
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// The x86 kernels below compute exact box filters (rounding down),
+// the same as the scalar code that handles the leftover columns.
+
+static inline uint8_t decimate2_pixel(const uint8_t *r0, const uint8_t *r1, int x)
+{
+    return (r0[2*x] + r0[2*x+1] + r1[2*x] + r1[2*x+1]) >> 2;
+}
+
+static void decimate2(uint8_t * __restrict dest, int destwidth, int destheight, int deststride,
+                      const uint8_t * __restrict src, int srcstride)
+{
+    for (int y = 0; y < destheight; y++) {
+        const uint8_t *r0 = &src[2*y*srcstride], *r1 = r0 + srcstride;
+        uint8_t *out = &dest[y*deststride];
+        int x = 0;
+
+#ifdef __AVX2__
+        const __m256i lo8 = _mm256_set1_epi16(0x00ff);
+
+        for (; x + 32 <= destwidth; x += 32) {
+            __m256i a0 = _mm256_loadu_si256((const __m256i*) &r0[2*x]);
+            __m256i a1 = _mm256_loadu_si256((const __m256i*) &r0[2*x + 32]);
+            __m256i b0 = _mm256_loadu_si256((const __m256i*) &r1[2*x]);
+            __m256i b1 = _mm256_loadu_si256((const __m256i*) &r1[2*x + 32]);
+
+            // horizontal pairs, summed as 16 bit lanes
+            __m256i s0 = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a0, lo8), _mm256_srli_epi16(a0, 8)),
+                                          _mm256_add_epi16(_mm256_and_si256(b0, lo8), _mm256_srli_epi16(b0, 8)));
+            __m256i s1 = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a1, lo8), _mm256_srli_epi16(a1, 8)),
+                                          _mm256_add_epi16(_mm256_and_si256(b1, lo8), _mm256_srli_epi16(b1, 8)));
+
+            // packing works within 128 bit lanes; put them back in order.
+            __m256i v = _mm256_packus_epi16(_mm256_srli_epi16(s0, 2), _mm256_srli_epi16(s1, 2));
+            _mm256_storeu_si256((__m256i*) &out[x], _mm256_permute4x64_epi64(v, 0xd8));
+        }
+#endif
+
+#ifdef __SSE2__
+        const __m128i lo8_128 = _mm_set1_epi16(0x00ff);
+
+        for (; x + 16 <= destwidth; x += 16) {
+            __m128i a0 = _mm_loadu_si128((const __m128i*) &r0[2*x]);
+            __m128i a1 = _mm_loadu_si128((const __m128i*) &r0[2*x + 16]);
+            __m128i b0 = _mm_loadu_si128((const __m128i*) &r1[2*x]);
+            __m128i b1 = _mm_loadu_si128((const __m128i*) &r1[2*x + 16]);
+
+            __m128i s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, lo8_128), _mm_srli_epi16(a0, 8)),
+                                       _mm_add_epi16(_mm_and_si128(b0, lo8_128), _mm_srli_epi16(b0, 8)));
+            __m128i s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, lo8_128), _mm_srli_epi16(a1, 8)),
+                                       _mm_add_epi16(_mm_and_si128(b1, lo8_128), _mm_srli_epi16(b1, 8)));
+
+            _mm_storeu_si128((__m128i*) &out[x],
+                             _mm_packus_epi16(_mm_srli_epi16(s0, 2), _mm_srli_epi16(s1, 2)));
+        }
+#endif
+
+        for (; x < destwidth; x++)
+            out[x] = decimate2_pixel(r0, r1, x);
+    }
+}
+
+static void decimate4(uint8_t * __restrict dest, int destwidth, int destheight, int deststride,
+                      const uint8_t * __restrict src, int srcstride)
+{
+    for (int y = 0; y < destheight; y++) {
+        const uint8_t *r0 = &src[4*y*srcstride];
+        uint8_t *out = &dest[y*deststride];
+        int x = 0;
+
+        // sum horizontal pairs as 16 bit lanes over the four rows,
+        // then adjacent pairs of those as 32 bit lanes.
+#ifdef __AVX2__
+        const __m256i lo8 = _mm256_set1_epi16(0x00ff);
+        const __m256i ones = _mm256_set1_epi16(1);
+        const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+        for (; x + 32 <= destwidth; x += 32) {
+            __m256i q[4];
+
+            for (int i = 0; i < 4; i++) {
+                __m256i p = _mm256_setzero_si256();
+
+                for (int dy = 0; dy < 4; dy++) {
+                    __m256i a = _mm256_loadu_si256((const __m256i*) &r0[dy*srcstride + 4*x + 32*i]);
+                    p = _mm256_add_epi16(p, _mm256_add_epi16(_mm256_and_si256(a, lo8), _mm256_srli_epi16(a, 8)));
+                }
+
+                q[i] = _mm256_srli_epi32(_mm256_madd_epi16(p, ones), 4);
+            }
+
+            __m256i v = _mm256_packus_epi16(_mm256_packs_epi32(q[0], q[1]), _mm256_packs_epi32(q[2], q[3]));
+            _mm256_storeu_si256((__m256i*) &out[x], _mm256_permutevar8x32_epi32(v, order));
+        }
+#endif
+
+#ifdef __SSE2__
+        const __m128i lo8_128 = _mm_set1_epi16(0x00ff);
+        const __m128i ones_128 = _mm_set1_epi16(1);
+
+        for (; x + 16 <= destwidth; x += 16) {
+            __m128i q[4];
+
+            for (int i = 0; i < 4; i++) {
+                __m128i p = _mm_setzero_si128();
+
+                for (int dy = 0; dy < 4; dy++) {
+                    __m128i a = _mm_loadu_si128((const __m128i*) &r0[dy*srcstride + 4*x + 16*i]);
+                    p = _mm_add_epi16(p, _mm_add_epi16(_mm_and_si128(a, lo8_128), _mm_srli_epi16(a, 8)));
+                }
+
+                q[i] = _mm_srli_epi32(_mm_madd_epi16(p, ones_128), 4);
+            }
+
+            _mm_storeu_si128((__m128i*) &out[x],
+                             _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3])));
+        }
+#endif
+
+        for (; x < destwidth; x++) {
+            uint32_t v = 0;
+            for (int dy = 0; dy < 4; dy++) {
+                const uint8_t *r = &r0[dy*srcstride + 4*x];
+                v += r[0] + r[1] + r[2] + r[3];
+            }
+            out[x] = v >> 4;
+        }
+    }
+}
+
+// dst[x] = wa*a[x] + b[x] + c[x] for x in [0, width), where b and c
+// may be NULL (and count as 0). Values stay below 2^16 as long as
+// wa + 2 <= 257.
+static void decimate_sum_rows(uint16_t * __restrict dst, int wa, const uint8_t *a,
+                              const uint8_t *b, const uint8_t *c, int width)
+{
+    int x = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vwa = _mm_set1_epi16(wa);
+
+    for (; x + 16 <= width; x += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*) &a[x]);
+        __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), vwa);
+        __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), vwa);
+
+        if (b != NULL) {
+            __m128i vb = _mm_loadu_si128((const __m128i*) &b[x]);
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(vb, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(vb, zero));
+        }
+
+        if (c != NULL) {
+            __m128i vc = _mm_loadu_si128((const __m128i*) &c[x]);
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(vc, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(vc, zero));
+        }
+
+        _mm_storeu_si128((__m128i*) &dst[x], lo);
+        _mm_storeu_si128((__m128i*) &dst[x + 8], hi);
+    }
+#endif
+
+    for (; x < width; x++)
+        dst[x] = wa*a[x] + (b ? b[x] : 0) + (c ? c[x] : 0);
+}
+
+// floor(v / d) as (v * recip) >> 32, with recip = 2^32 / d rounded
+// up. Exact as long as v * d < 2^32.
+static inline uint32_t decimate_recip(uint32_t d)
+{
+    return (uint32_t) (((1ULL << 32) + d - 1) / d);
+}
+
+static inline uint32_t decimate_div(uint32_t v, uint32_t recip)
+{
+    return (uint32_t) (((uint64_t) v * recip) >> 32);
+}
+
 image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
 {
     int width = im->width, height = im->height;
@@ -475,44 +661,39 @@ image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
 
         image_u8_t *decim = image_u8_create(swidth, sheight);
 
-        int y = 0, sy = 0;
-        while (sy < sheight) {
-            int x = 0, sx = 0;
-            while (sx < swidth) {
-
-                // a b c
-                // d e f
-                // g h i
-                uint8_t a = im->buf[(y+0)*im->stride + (x+0)];
-                uint8_t b = im->buf[(y+0)*im->stride + (x+1)];
-                uint8_t c = im->buf[(y+0)*im->stride + (x+2)];
-
-                uint8_t d = im->buf[(y+1)*im->stride + (x+0)];
-                uint8_t e = im->buf[(y+1)*im->stride + (x+1)];
-                uint8_t f = im->buf[(y+1)*im->stride + (x+2)];
-
-                uint8_t g = im->buf[(y+2)*im->stride + (x+0)];
-                uint8_t h = im->buf[(y+2)*im->stride + (x+1)];
-                uint8_t i = im->buf[(y+2)*im->stride + (x+2)];
-
-                decim->buf[(sy+0)*decim->stride + (sx + 0)] =
-                    (4*a+2*b+2*d+e)/9;
-                decim->buf[(sy+0)*decim->stride + (sx + 1)] =
-                    (4*c+2*b+2*f+e)/9;
-
-                decim->buf[(sy+1)*decim->stride + (sx + 0)] =
-                    (4*g+2*d+2*h+e)/9;
-                decim->buf[(sy+1)*decim->stride + (sx + 1)] =
-                    (4*i+2*f+2*h+e)/9;
-
-                x += 3;
-                sx += 2;
+        // Each 3x3 block becomes a 2x2 block; every output pixel is
+        // the mean of the 1.5x1.5 source area it covers:
+        //
+        // a b c
+        // d e f     (4a + 2b + 2d + e) / 9   (4c + 2b + 2f + e) / 9
+        // g h i     (4g + 2d + 2h + e) / 9   (4i + 2f + 2h + e) / 9
+        //
+        // We first combine rows: top = 2*(a b c) + (d e f) and
+        // bottom = 2*(g h i) + (d e f), then columns.
+        uint16_t *top = malloc(width * sizeof(uint16_t));
+        uint16_t *bottom = malloc(width * sizeof(uint16_t));
+        uint32_t recip = decimate_recip(9);
+
+        for (int sy = 0; sy < sheight; sy += 2) {
+            const uint8_t *r0 = &im->buf[(sy/2*3)*im->stride];
+
+            decimate_sum_rows(top, 2, r0, r0 + im->stride, NULL, swidth / 2 * 3);
+            decimate_sum_rows(bottom, 2, r0 + 2*im->stride, r0 + im->stride, NULL, swidth / 2 * 3);
+
+            uint8_t *out0 = &decim->buf[sy*decim->stride];
+            uint8_t *out1 = out0 + decim->stride;
+
+            for (int sx = 0, x = 0; sx < swidth; sx += 2, x += 3) {
+                out0[sx+0] = decimate_div(2*top[x] + top[x+1], recip);
+                out0[sx+1] = decimate_div(2*top[x+2] + top[x+1], recip);
+                out1[sx+0] = decimate_div(2*bottom[x] + bottom[x+1], recip);
+                out1[sx+1] = decimate_div(2*bottom[x+2] + bottom[x+1], recip);
             }
-
-            y += 3;
-            sy += 2;
         }
 
+        free(top);
+        free(bottom);
+
         return decim;
     }
 
@@ -539,66 +720,54 @@ image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
 #endif
 
     if (factor == 2) {
-        for (int sy = 0; sy < sheight; sy++) {
-            int sidx = sy * decim->stride;
-            int idx = (sy*2)*im->stride;
-
-            for (int sx = 0; sx < swidth; sx++) {
-                uint32_t v = im->buf[idx] + im->buf[idx+1] +
-                    im->buf[idx+im->stride] + im->buf[idx+im->stride + 1];
-                decim->buf[sidx] = (v>>2);
-                idx+=2;
-                sidx++;
-            }
-        }
+        decimate2(decim->buf, swidth, sheight, decim->stride, im->buf, im->stride);
+    } else if (factor == 4) {
+        decimate4(decim->buf, swidth, sheight, decim->stride, im->buf, im->stride);
     } else if (factor == 3) {
-        for (int sy = 0; sy < sheight; sy++) {
-            int sidx = sy * decim->stride;
-            int idx = (sy*3)*im->stride;
+        uint16_t *row = malloc(width * sizeof(uint16_t));
+        uint32_t recip = decimate_recip(9);
 
-            for (int sx = 0; sx < swidth; sx++) {
-                uint32_t v = im->buf[idx] + im->buf[idx+1] + im->buf[idx+2] +
-                    im->buf[idx+im->stride] + im->buf[idx+im->stride + 1] + im->buf[idx+im->stride + 2] +
-                    im->buf[idx+2*im->stride] + im->buf[idx+2*im->stride + 1];
-                // + im->buf[idx+2*im->stride + 1];
-                // deliberately omit lower right corner so there are exactly 8 samples...
-                decim->buf[sidx] = (v>>3);
-                idx+=3;
-                sidx++;
-            }
-        }
-    } else if (factor == 4) {
         for (int sy = 0; sy < sheight; sy++) {
-            int sidx = sy * decim->stride;
-            int idx = (sy*4)*im->stride;
+            const uint8_t *r0 = &im->buf[(sy*3)*im->stride];
+            decimate_sum_rows(row, 1, r0, r0 + im->stride, r0 + 2*im->stride, swidth*3);
 
-            for (int sx = 0; sx < swidth; sx++) {
-                uint32_t v = im->buf[idx] + im->buf[idx+1] + im->buf[idx+2] + im->buf[idx+3] +
-                im->buf[idx+im->stride] + im->buf[idx+im->stride + 1] + im->buf[idx+im->stride + 1] + im->buf[idx+im->stride + 2] +
-                im->buf[idx+2*im->stride] + im->buf[idx+2*im->stride + 1] + im->buf[idx+2*im->stride + 2] + im->buf[idx+2*im->stride + 3];
-
-                decim->buf[sidx] = (v>>4);
-                idx+=4;
-                sidx++;
-            }
+            uint8_t *out = &decim->buf[sy*decim->stride];
+            for (int sx = 0; sx < swidth; sx++)
+                out[sx] = decimate_div(row[3*sx] + row[3*sx+1] + row[3*sx+2], recip);
         }
-    } else {
-        // XXX this isn't a very good decimation code.
-        uint32_t row[swidth];
 
-        for (int y = 0; y < height; y+= factor) {
-            memset(row, 0, sizeof(row));
+        free(row);
+    } else if (factor > 1) {
+        // any other integer factor: sum factor rows, then factor
+        // columns.
+        uint32_t *row = malloc(swidth * factor * sizeof(uint32_t));
+        uint32_t area = factor * factor;
+        uint32_t recip = decimate_recip(area);
+        int exact = (uint64_t) 255 * area * area < (1ULL << 32);
+
+        for (int sy = 0; sy < sheight; sy++) {
+            memset(row, 0, swidth * factor * sizeof(uint32_t));
 
             for (int dy = 0; dy < factor; dy++) {
-                for (int x = 0; x < width; x++) {
-                    row[x/factor] += im->buf[(y+dy)*im->stride + x];
-                }
+                const uint8_t *src = &im->buf[(sy*factor + dy)*im->stride];
+                for (int x = 0; x < swidth * factor; x++)
+                    row[x] += src[x];
             }
 
-            for (int x = 0; x < swidth; x++)
-                decim->buf[(y/factor)*decim->stride + x] = row[x] / sq(factor);
+            uint8_t *out = &decim->buf[sy*decim->stride];
+            for (int sx = 0; sx < swidth; sx++) {
+                uint32_t v = 0;
+                for (int dx = 0; dx < factor; dx++)
+                    v += row[sx*factor + dx];
 
+                out[sx] = exact ? decimate_div(v, recip) : v / area;
+            }
         }
+
+        free(row);
+    } else {
+        for (int y = 0; y < height; y++)
+            memcpy(&decim->buf[y*decim->stride], &im->buf[y*im->stride], width);
     }
 
     return decim;
@@ -45,6 +45,24 @@ unionfind_t *unionfind_create(uint32_t maxid)
     return uf;
 }
 
+unionfind_t *unionfind_create_uninitialized(uint32_t maxid)
+{
+    unionfind_t *uf = (unionfind_t*) calloc(1, sizeof(unionfind_t));
+    uf->maxid = maxid;
+    uf->data = (struct ufrec*) malloc((maxid+1) * sizeof(struct ufrec));
+    return uf;
+}
+
+void unionfind_init_range(unionfind_t *uf, uint32_t id0, uint32_t id1)
+{
+    assert(id1 <= uf->maxid + 1);
+
+    for (uint32_t i = id0; i < id1; i++) {
+        uf->data[i].size = 1;
+        uf->data[i].parent = i;
+    }
+}
+
 void unionfind_destroy(unionfind_t *uf)
 {
     free(uf->data);
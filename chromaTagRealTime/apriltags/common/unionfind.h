@@ -49,6 +49,15 @@ struct ufrec
 };
 
 unionfind_t *unionfind_create(uint32_t maxid);
+
+// like unionfind_create, but leaves every id uninitialized; call
+// unionfind_init_range on every id before it is used. Useful when
+// only a small part of a large id space is ever touched.
+unionfind_t *unionfind_create_uninitialized(uint32_t maxid);
+
+// make each of the ids in [id0, id1) a set by itself.
+void unionfind_init_range(unionfind_t *uf, uint32_t id0, uint32_t id1);
+
 void unionfind_destroy(unionfind_t *uf);
 
 static inline uint32_t unionfind_get_representative(unionfind_t *uf, uint32_t id)
@@ -32,17 +32,34 @@ either expressed or implied, of the FreeBSD Project.
 #ifndef _WORKERPOOL_H
 #define _WORKERPOOL_H
 
+#include <stdint.h>
+
 #include "zarray.h"
 
 typedef struct workerpool workerpool_t;
 
-// as a special case, if nthreads==1, no additional threads are
-// created, and workerpool_run will run synchronously.
+// nthreads counts the thread that calls workerpool_run, which runs
+// tasks too; nthreads-1 additional threads are created. (So if
+// nthreads==1, workerpool_run runs synchronously.)
 workerpool_t *workerpool_create(int nthreads);
 void workerpool_destroy(workerpool_t *wp);
 
+// Tasks are started roughly in the order they were added.
 void workerpool_add_task(workerpool_t *wp, void (*f)(void *p), void *p);
 
+// Like workerpool_add_task, but with an estimate of the task's cost
+// (in any consistent unit). workerpool_run starts tasks in decreasing
+// order of cost, ties in the order they were added.
+void workerpool_add_task_cost(workerpool_t *wp, void (*f)(void *p), void *p, double cost);
+
+// Splits items [0, n) into about maxchunks contiguous chunks of
+// roughly equal total cost; an item costing at least the average
+// chunk (total / maxchunks) gets a chunk of its own, which can make
+// up to about twice as many chunks. Chunk i is [bounds[i],
+// bounds[i+1]), so bounds must have room for n+1 entries. Returns the
+// number of chunks.
+int workerpool_partition(const double *costs, int n, int maxchunks, int *bounds);
+
 // runs all added tasks, waits for them to complete.
 void workerpool_run(workerpool_t *wp);
 
@@ -51,4 +68,15 @@ void workerpool_run_single(workerpool_t *wp);
 
 int workerpool_get_nthreads(workerpool_t *wp);
 
+// pins worker thread i (1 <= i < nthreads) to CPU (first_cpu + i) mod
+// ncpus. The thread calling workerpool_run is left alone. Returns 0
+// on success, -1 on failure or where unsupported (non-Linux).
+int workerpool_pin_threads(workerpool_t *wp, int first_cpu);
+
+// fills busy_utime[0..nthreads-1] with the time each thread has spent
+// running tasks since the pool was created (or last reset). Entry 0
+// is the thread calling workerpool_run.
+void workerpool_get_busy_utime(workerpool_t *wp, int64_t *busy_utime);
+void workerpool_reset_busy_utime(workerpool_t *wp);
+
 #endif
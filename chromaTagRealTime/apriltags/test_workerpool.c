@@ -0,0 +1,118 @@
+/* (C) 2013-2014, The Regents of The University of Michigan
+All rights reserved.
+
+This software may be available under alternative licensing
+terms. Contact Edwin Olson, ebolson@umich.edu, for more information.
+
+   Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+ */
+
+// Runs many small workerpools back to back, as the detector and the
+// pipelined apps do, and checks that every task of every run runs
+// exactly once and that no run hangs. Run from the Makefile's test
+// target.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "common/workerpool.h"
+
+#define MAX_TASKS 64
+#define NRUNS     20000
+
+static int nthreads_now, run_now;
+
+static void timeout(int sig)
+{
+    // not async-signal-safe, but we're leaving anyway.
+    printf("FAIL %d threads: run %d hung\n", nthreads_now, run_now);
+    fflush(stdout);
+    _exit(1);
+}
+
+struct count_arg
+{
+    int count;
+    int spin;
+};
+
+static void count_task(void *p)
+{
+    struct count_arg *arg = p;
+    __atomic_add_fetch(&arg->count, 1, __ATOMIC_RELAXED);
+
+    // vary the tasks' lengths, so that threads finish at different
+    // times and steal from each other.
+    for (volatile int i = arg->spin; i > 0; i--)
+        ;
+}
+
+int main(int argc, char *argv[])
+{
+    int nthreads[] = { 2, 3, 4, 8 };
+    struct count_arg args[MAX_TASKS];
+    int failures = 0;
+
+    signal(SIGALRM, timeout);
+    srand(1);
+
+    for (int t = 0; t < sizeof(nthreads) / sizeof(int); t++) {
+        workerpool_t *wp = workerpool_create(nthreads[t]);
+        nthreads_now = nthreads[t];
+
+        int bad = 0;
+        alarm(60);
+
+        for (int run = 0; run < NRUNS; run++) {
+            run_now = run;
+
+            int ntasks = 1 + rand() % MAX_TASKS;
+            for (int i = 0; i < ntasks; i++) {
+                args[i].count = 0;
+                args[i].spin = rand() % 400;
+                workerpool_add_task_cost(wp, count_task, &args[i], rand() % 3 ? args[i].spin : 0);
+            }
+
+            workerpool_run(wp);
+
+            for (int i = 0; i < ntasks; i++)
+                if (__atomic_load_n(&args[i].count, __ATOMIC_RELAXED) != 1)
+                    bad++;
+        }
+
+        alarm(0);
+        workerpool_destroy(wp);
+
+        printf("%-4s %d threads: %d runs, %d tasks not run exactly once\n",
+               bad ? "FAIL" : "ok", nthreads[t], NRUNS, bad);
+        failures += bad > 0;
+    }
+
+    return failures ? 1 : 0;
+}
@@ -3,8 +3,13 @@
 #include <inttypes.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
 
 #include "apriltags/apriltag.h"
+#include "apriltags/apriltag_tracker.h"
+#include "apriltags/apriltag_resolution.h"
 #include "apriltags/common/image_u8.h"
 #include "apriltags/tag36h11.h"
 #include "apriltags/tag36h10.h"
@@ -14,31 +19,567 @@
 
 #include "apriltags/common/zarray.h"
 #include "apriltags/common/getopt.h"
+#include "apriltags/common/time_util.h"
 
 // Our extensions for chromatags
 #include "lib/rgb2lab.hpp" // functions to convert to rgb to lab, and seperate color channels
 #include "lib/pnm2mat.hpp" // functions to convert pnm to and from mat
+#include "lib/pipeline.hpp" // queues and counters for the capture/convert/detect/output threads
 
-int main(){
+/**
+ * The realtime loop runs as four stages on their own threads, so
+ * throughput is limited by the slowest stage instead of the sum:
+ *
+ *   capture -> [mailbox] -> convert -> [queue] -> detect -> [queue] -> output
+ *
+ * Capture always posts the newest camera frame; if convert has not
+ * taken the previous one it is dropped. At most `depth` frames are
+ * between convert and output at once, which bounds the latency and
+ * the memory held by the queues. Output runs on the main thread
+ * because imshow/waitKey must.
+ *
+ * With a budget (-b), detect also picks the resolution of the next
+ * frames: convert resizes by the latest scale it published and keeps
+ * the decimation picked with it in the frame, so frames already
+ * queued at the old scale are still detected at the old decimation.
+ *
+ * With several sources (-s), see run_sources below.
+ */
 
-  bool showGradient = false;
-  bool found = false;
-  
-  int w = 768;
-  int h = 432;
-  
-  VideoCapture cap(0); // open the default camera
-  Size size(w,h);  // size of desired frame origionally 1280x720, 1024x576, 854x480
-  if(!cap.isOpened())  // check if camera opened
+struct frame_t {
+  Mat src;                      // camera frame, drawn on by output
+  int64_t capture_utime;
+
+  int w, h;
+  image_u8_t *im;               // converted image for the detector
+  double scale;                 // im is src resized by this
+  float quad_decimate;          // detect im with this, picked along with scale
+  double convert_ms;
+
+  int source;                   // index into the sources, with -s
+
+  zarray_t *detections;
+  double detect_ms;
+  int nquads;
+  int ntracks;
+};
+
+static void frame_destroy(frame_t *f){
+  if(f == NULL)
+    return;
+  if(f->im)
+    image_u8_destroy(f->im);
+  if(f->detections){
+    for(int i = 0; i < zarray_size(f->detections); i++){
+      apriltag_detection_t *det;
+      zarray_get(f->detections, i, &det);
+      apriltag_detection_destroy(det);
+    }
+    zarray_destroy(f->detections);
+  }
+  delete f;
+}
+
+struct pipeline_t {
+  VideoCapture *cap;
+  apriltag_tracker_t *tt;       // detects tags near where they were last seen
+  apriltag_resolution_t *rc;    // chooses the detection resolution, or NULL
+  pthread_mutex_t res_lock;     // guards scale and quad_decimate
+  double scale;                 // for the next frames; written by detect
+  float quad_decimate;          // goes with scale
+  double track_scale;           // of the frames the tracks are in (detect only)
+  bool showGradient;
+  int depth;                    // max frames between convert and output
+
+  int running;
+  int inflight;
+
+  mailbox<frame_t> captured;
+  spsc_queue<frame_t*> converted;
+  spsc_queue<frame_t*> detected;
+
+  stage_stats capture_stats, convert_stats, detect_stats, output_stats;
+
+  pipeline_t(int d) : rc(NULL), scale(1), quad_decimate(1), track_scale(1),
+                      depth(d), running(1), inflight(0),
+                      converted(d), detected(d),
+                      capture_stats("capture"), convert_stats("convert"),
+                      detect_stats("detect"), output_stats("output") {
+    pthread_mutex_init(&res_lock, NULL);
+  }
+
+  ~pipeline_t() { pthread_mutex_destroy(&res_lock); }
+
+  bool is_running(){ return __atomic_load_n(&running, __ATOMIC_ACQUIRE); }
+};
+
+static void *capture_thread(void *p){
+  pipeline_t *pl = (pipeline_t*) p;
+
+  while(pl->is_running()){
+    frame_t *f = new frame_t();
+    *pl->cap >> f->src;                                      // Get a new frame from camera
+    int64_t t0 = utime_now();
+    f->capture_utime = t0;
+
+    if(f->src.empty()){
+      delete f;
+      pipeline_idle();
+      continue;
+    }
+
+    frame_destroy(pl->captured.post(f));                     // Drop the stale frame, if any
+    pl->capture_stats.add(t0);
+  }
+  return NULL;
+}
+
+// Make the detector's image from the camera frame, resized by
+// f->scale. Returns false (having said why) if that failed.
+static bool frame_convert(frame_t *f, bool showGradient){
+  int64_t t0 = utime_now();
+
+  Mat frame;
+  if(f->scale < 1)
+    resize(f->src, frame, Size(), f->scale, f->scale, INTER_AREA);
+  else
+    frame = f->src.clone();
+  f->w = frame.size().width;
+  f->h = frame.size().height;
+  frame = RGB2LAB(frame);                                     // Returns lab space
+  frame = alphaLAB(frame);                                    // Look at only a channel
+
+  if(showGradient){
+    f->src = gradientEdges(f->src);                           // Show gradient for fun
+  }
+
+  pnm_t *pnm = mat2pnm(&frame);
+  f->im = pnm_to_image_u8(pnm);                               // Convert pnm to gray image_u8
+  if(f->im == NULL){                                          // Error - no image created from pnm
+    std::cout << "Error, not a proper pnm" << std::endl;
+    return false;
+  }
+  f->convert_ms = (utime_now() - t0) / 1.0E3;
+  return true;
+}
+
+static void *convert_thread(void *p){
+  pipeline_t *pl = (pipeline_t*) p;
+
+  while(pl->is_running()){
+    if(__atomic_load_n(&pl->inflight, __ATOMIC_ACQUIRE) >= pl->depth){
+      pipeline_idle();
+      continue;
+    }
+
+    frame_t *f = pl->captured.take();
+    if(f == NULL){
+      pipeline_idle();
+      continue;
+    }
+    int64_t t0 = utime_now();
+
+    pthread_mutex_lock(&pl->res_lock);
+    f->scale = pl->scale;
+    f->quad_decimate = pl->quad_decimate;
+    pthread_mutex_unlock(&pl->res_lock);
+    if(!frame_convert(f, pl->showGradient)){
+      frame_destroy(f);
+      continue;
+    }
+
+    __atomic_add_fetch(&pl->inflight, 1, __ATOMIC_ACQ_REL);
+    while(!pl->converted.push(f)){
+      if(!pl->is_running()){
+        frame_destroy(f);
+        return NULL;
+      }
+      pipeline_idle();
+    }
+    pl->convert_stats.add(t0);
+  }
+  return NULL;
+}
+
+static void *detect_thread(void *p){
+  pipeline_t *pl = (pipeline_t*) p;
+
+  while(pl->is_running()){
+    frame_t *f;
+    if(!pl->converted.pop(&f)){
+      pipeline_idle();
+      continue;
+    }
+    int64_t t0 = utime_now();
+
+    if(f->scale != pl->track_scale){                          // Frame resized since the last one
+      apriltag_tracker_rescale(pl->tt, f->scale / pl->track_scale);
+      pl->track_scale = f->scale;
+    }
+
+    pl->tt->td->quad_decimate = f->quad_decimate;
+    f->detections = apriltag_tracker_update(pl->tt, f->im);
+    f->nquads = pl->tt->td->nquads;
+    f->ntracks = zarray_size(pl->tt->tracks);
+    f->detect_ms = (utime_now() - t0) / 1.0E3;
+
+    if(pl->rc){                                               // Pick the resolution for the next frames
+      apriltag_resolution_update(pl->rc, pl->tt, f->scale, f->convert_ms + f->detect_ms);
+      pthread_mutex_lock(&pl->res_lock);
+      pl->scale = pl->rc->scale;
+      pl->quad_decimate = pl->rc->quad_decimate;
+      pthread_mutex_unlock(&pl->res_lock);
+    }
+    image_u8_destroy(f->im);
+    f->im = NULL;
+
+    while(!pl->detected.push(f)){
+      if(!pl->is_running()){
+        frame_destroy(f);
+        return NULL;
+      }
+      pipeline_idle();
+    }
+    pl->detect_stats.add(t0);
+  }
+  return NULL;
+}
+
+/**
+ * Several cameras in one process (-s 0,1,...), sharing one detector
+ * (and its decode tables) and one pool of detection threads:
+ *
+ *   capture (per source) -> [mailbox] --+
+ *   capture (per source) -> [mailbox] --+-> scheduler -> [queue] -> output
+ *
+ * The scheduler works in rounds: it takes the newest frame of every
+ * source that has one and converts and tracks all of them as tasks
+ * on the shared work-stealing pool, most expensive first. So every
+ * source gets one frame per round, however fast its camera. Each
+ * source has its own tracker and detection context, so it keeps its
+ * own tracks and statistics. A video file can stand in for a camera;
+ * it is played at its own frame rate, over and over.
+ */
+
+struct source_t {
+  int index;
+  std::string name;
+  VideoCapture cap;
+  bool file;
+  double file_fps;
+
+  apriltag_tracker_t *tt;
+  apriltag_detect_context_t *ctx;
+  bool showGradient;
+
+  mailbox<frame_t> captured;
+  frame_t *work;                // this round's frame (scheduler and its task)
+  double cost_ms;               // of the last frame, for ordering the tasks
+
+  pthread_t thread;
+  int *running;
+
+  // owned by the output thread
+  int window_frames;
+  int64_t window_utime;
+  double latency_sum, detect_sum;
+  char statString[160];
+};
+
+static void *source_capture_thread(void *p){
+  source_t *s = (source_t*) p;
+  int64_t next_utime = utime_now();
+
+  while(__atomic_load_n(s->running, __ATOMIC_ACQUIRE)){
+    frame_t *f = new frame_t();
+    s->cap >> f->src;
+
+    if(f->src.empty()){
+      delete f;
+      if(s->file)
+        s->cap.set(CV_CAP_PROP_POS_FRAMES, 0);                // Play the file again
+      else
+        pipeline_idle();
+      continue;
+    }
+
+    if(s->file){                                              // Keep to the file's frame rate
+      next_utime += 1.0E6 / s->file_fps;
+      int64_t wait = next_utime - utime_now();
+      if(wait > 0)
+        usleep(wait);
+      else
+        next_utime = utime_now();
+    }
+
+    f->capture_utime = utime_now();
+    f->source = s->index;
+    f->scale = 1;
+    frame_destroy(s->captured.post(f));                       // Drop the stale frame, if any
+  }
+  return NULL;
+}
+
+static void source_task(void *p){
+  source_t *s = (source_t*) p;
+  frame_t *f = s->work;
+
+  if(!frame_convert(f, s->showGradient)){
+    frame_destroy(f);
+    s->work = NULL;
+    return;
+  }
+
+  int64_t t0 = utime_now();
+  f->detections = apriltag_tracker_update(s->tt, f->im);
+  f->nquads = s->ctx->nquads;
+  f->ntracks = zarray_size(s->tt->tracks);
+  f->detect_ms = (utime_now() - t0) / 1.0E3;
+  image_u8_destroy(f->im);
+  f->im = NULL;
+
+  s->cost_ms = f->convert_ms + f->detect_ms;
+}
+
+struct scheduler_t {
+  std::vector<source_t*> sources;
+  workerpool_t *wp;
+  int depth;                    // max frames between scheduling and output
+
+  int running;
+  int inflight;
+  spsc_queue<frame_t*> *detected;
+  stage_stats stats;
+
+  scheduler_t() : running(1), inflight(0), stats("detect") {}
+};
+
+static void *scheduler_thread(void *p){
+  scheduler_t *sc = (scheduler_t*) p;
+  int nsources = sc->sources.size();
+
+  while(__atomic_load_n(&sc->running, __ATOMIC_ACQUIRE)){
+    if(__atomic_load_n(&sc->inflight, __ATOMIC_ACQUIRE) >= sc->depth){
+      pipeline_idle();
+      continue;
+    }
+
+    int64_t t0 = utime_now();
+    int n = 0;
+    for(int i = 0; i < nsources; i++){
+      source_t *s = sc->sources[i];
+      s->work = s->captured.take();
+      if(s->work == NULL)
+        continue;
+      workerpool_add_task_cost(sc->wp, source_task, s, s->cost_ms);
+      n++;
+    }
+
+    if(n == 0){
+      pipeline_idle();
+      continue;
+    }
+
+    workerpool_run(sc->wp);
+
+    for(int i = 0; i < nsources; i++){
+      frame_t *f = sc->sources[i]->work;
+      if(f == NULL)
+        continue;
+      sc->sources[i]->work = NULL;
+
+      __atomic_add_fetch(&sc->inflight, 1, __ATOMIC_ACQ_REL);
+      while(!sc->detected->push(f)){
+        if(!__atomic_load_n(&sc->running, __ATOMIC_ACQUIRE)){
+          frame_destroy(f);
+          break;
+        }
+        pipeline_idle();
+      }
+    }
+    sc->stats.add(t0);
+  }
+  return NULL;
+}
+
+// Run the sources in names (comma separated: camera numbers or video
+// files) until a key is pressed.
+static int run_sources(apriltag_detector_t *td, const char *names, getopt_t *getopt){
+  scheduler_t *sc = new scheduler_t();
+  sc->depth = getopt_get_int(getopt, "depth");
+  if(sc->depth < 1)
+    sc->depth = 1;
+
+  std::string list(names);
+  for(size_t pos = 0; pos <= list.size(); ){
+    size_t comma = list.find(',', pos);
+    if(comma == std::string::npos)
+      comma = list.size();
+    std::string name = list.substr(pos, comma - pos);
+    pos = comma + 1;
+    if(name.empty())
+      continue;
+
+    source_t *s = new source_t();
+    s->index = sc->sources.size();
+    s->name = name;
+
+    char *end;
+    long device = strtol(name.c_str(), &end, 10);
+    s->file = (*end != 0);
+    if(s->file)
+      s->cap.open(name);
+    else
+      s->cap.open(device);
+
+    if(!s->cap.isOpened()){
+      std::cout << "Can't open source " << name << std::endl;
+      delete s;
+      continue;
+    }
+
+    s->file_fps = s->file ? s->cap.get(CV_CAP_PROP_FPS) : 0;
+    if(s->file && !(s->file_fps > 0))
+      s->file_fps = 30;
+
+    s->ctx = apriltag_detect_context_create(1);               // Threads come from the shared pool
+    s->tt = apriltag_tracker_create(td);
+    s->tt->ctx = s->ctx;
+    s->tt->discovery_interval = getopt_get_int(getopt, "discovery");
+    s->tt->track_edges = getopt_get_bool(getopt, "edges");
+    s->showGradient = getopt_get_bool(getopt, "gradient");
+    s->running = &sc->running;
+    s->window_utime = utime_now();
+    sprintf(s->statString, "fps: -");
+
+    sc->sources.push_back(s);
+  }
+
+  int nsources = sc->sources.size();
+  if(nsources == 0){
+    delete sc;
     return -1;
-  
-  Mat a, b, g, frame, src;
+  }
+
+  sc->wp = workerpool_create(getopt_get_int(getopt, "threads"));
+  sc->detected = new spsc_queue<frame_t*>(sc->depth * nsources);
+
+  for(int i = 0; i < nsources; i++)
+    pthread_create(&sc->sources[i]->thread, NULL, source_capture_thread, sc->sources[i]);
+  pthread_t scheduler;
+  pthread_create(&scheduler, NULL, scheduler_thread, sc);
+
+  int64_t report_utime = utime_now();
+
+  while(1){
+    frame_t *f;
+    if(!sc->detected->pop(&f)){
+      if(waitKey(1) >= 0) break;                              // Keep the windows responsive
+      continue;
+    }
+    int64_t t0 = utime_now();
+    source_t *s = sc->sources[f->source];
+
+    for(int i = 0; i < zarray_size(f->detections); i++){
+      apriltag_detection_t *det;
+      zarray_get(f->detections, i, &det);
+      Point pt1 = Point(det->p[0][0], det->p[0][1]);
+      Point pt2 = Point(det->p[2][0], det->p[2][1]);
+      cv::rectangle(f->src, pt1, pt2, cvScalar(102,255,0));
+    }
+
+    // per-source throughput and latency (capture to display),
+    // averaged over about a second
+    s->window_frames++;
+    s->latency_sum += (t0 - f->capture_utime) / 1.0E3;
+    s->detect_sum += f->convert_ms + f->detect_ms;
+    if(t0 - s->window_utime > 1000000){
+      sprintf(s->statString, "fps: %2.2f, latency: %5.1fms, detect: %5.1fms, tracks: %d, dropped: %" PRIu64,
+              s->window_frames * 1.0E6 / (t0 - s->window_utime), s->latency_sum / s->window_frames,
+              s->detect_sum / s->window_frames, f->ntracks, s->captured.ndropped());
+      s->window_utime = t0;
+      s->window_frames = 0;
+      s->latency_sum = 0;
+      s->detect_sum = 0;
+    }
+
+    putText(f->src, s->statString, cvPoint(30,30),
+            FONT_HERSHEY_COMPLEX_SMALL, 0.8, cvScalar(200,200,250), 1, CV_AA);
+    imshow("Source " + s->name, f->src);
+
+    frame_destroy(f);
+    __atomic_sub_fetch(&sc->inflight, 1, __ATOMIC_ACQ_REL);
+
+    if(t0 - report_utime > 1000000){
+      for(int i = 0; i < nsources; i++)
+        printf("source %s: %s\n", sc->sources[i]->name.c_str(), sc->sources[i]->statString);
+      printf("detect %3.0f%%\n", 100*sc->stats.occupancy());
+      report_utime = t0;
+    }
+
+    if(waitKey(1) >= 0) break;
+  }
+
+  __atomic_store_n(&sc->running, 0, __ATOMIC_RELEASE);
+  pthread_join(scheduler, NULL);
+
+  frame_t *f;
+  while(sc->detected->pop(&f))
+    frame_destroy(f);
+
+  for(int i = 0; i < nsources; i++){
+    source_t *s = sc->sources[i];
+    pthread_join(s->thread, NULL);
+    frame_destroy(s->captured.take());
+    apriltag_tracker_destroy(s->tt);
+    apriltag_detect_context_destroy(s->ctx);
+    delete s;
+  }
+
+  workerpool_destroy(sc->wp);
+  delete sc->detected;
+  delete sc;
+  return 0;
+}
+
+int main(int argc, char *argv[]){
+
+  getopt_t *getopt = getopt_create();
+
+  getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+  getopt_add_bool(getopt, 'q', "quiet", 0, "Reduce output");
+  getopt_add_bool(getopt, 'g', "gradient", 0, "Show the gradient of the camera image");
+  getopt_add_int(getopt, 't', "threads", "4", "Use this many CPU threads for detection");
+  getopt_add_int(getopt, 'd', "depth", "3", "Allow this many frames in flight between conversion and display");
+  getopt_add_int(getopt, 'D', "discovery", "30", "Search the whole frame for new tags at least every this many frames");
+  getopt_add_bool(getopt, 'e', "edges", 0, "Follow tracked tags by their edges instead of searching for them");
+  getopt_add_string(getopt, 's', "sources", "", "Track these cameras (numbers) or video files at once, comma separated, sharing the detection threads");
+  getopt_add_double(getopt, 'b', "budget", "0", "Lower the detection resolution to keep convert+detect within this many ms (0: full resolution)");
+  getopt_add_int(getopt, 'B', "decode-budget", "0", "Stop decoding quads, most tag-like first, after this many us per pass (0: decode all)");
+
+  if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+    printf("Usage: %s [options]\n", argv[0]);
+    getopt_do_usage(getopt);
+    exit(0);
+  }
+
+  const char *sources = getopt_get_string(getopt, "sources");
+  if(sources[0] != 0 && getopt_get_double(getopt, "budget") > 0){
+    printf("The resolution budget (-b) is for a single camera\n");
+    exit(-1);
+  }
+
+  VideoCapture cap;
+  if(sources[0] == 0){
+    cap.open(0); // open the default camera
+    if(!cap.isOpened())  // check if camera opened
+      return -1;
+  }
   
   /* From apriltag_demo.c */
   
-  int maxiters = 5;
   const int hamm_hist_max = 10;
-  int quiet = 0;
+  int quiet = getopt_get_bool(getopt, "quiet");
   
   apriltag_family_t *tf = tag36h11_create();                // Apriltag family 36h11, can change
   tf->black_border = 1;                                     // Set tag family border size
@@ -48,72 +589,76 @@ int main(){
   
   td->quad_decimate = 1.0;                                  // Decimate input image by factor
   td->quad_sigma = 0.0;                                     // No blur (I think)
-  td->nthreads = 4;                                         // 4 treads provided
+  td->nthreads = getopt_get_int(getopt, "threads");         // Threads for the detector's pool
   td->debug = 0;                                            // No debuging output
   td->refine_decode = 0;                                    // Don't refine decode
   td->refine_pose = 0;                                      // Don't refine pose
+  td->decode_budget_us = getopt_get_int(getopt, "decode-budget"); // Bound decoding in clutter
   
   // Output variables
   char imgSize[20];
-  char renderTime[20];
-  char detectString[50];
+  char renderTime[40];
+  char detectString[120];
   char convertTime[50];
   char displayString[120];
-  char outputString[120];
+  char outputString[160];
   char locationString[120];
-  double time_taken = 0.0;
-  
-  long double totalFPS = 0.0;
-  double count = 0.0;
+  char stageString[160];
   
   /* End of apriltag_demo.c */
-  
+
+  if(sources[0] != 0){
+    int res = run_sources(td, sources, getopt);
+    apriltag_detector_destroy(td);
+    tag36h11_destroy(tf);
+    getopt_destroy(getopt);
+    return res;
+  }
+
+  int depth = getopt_get_int(getopt, "depth");
+  if(depth < 1)
+    depth = 1;
+
+  pipeline_t *pl = new pipeline_t(depth);
+  pl->cap = &cap;
+  pl->tt = apriltag_tracker_create(td);
+  pl->quad_decimate = td->quad_decimate;
+  pl->tt->discovery_interval = getopt_get_int(getopt, "discovery");
+  pl->tt->track_edges = getopt_get_bool(getopt, "edges");
+  pl->showGradient = getopt_get_bool(getopt, "gradient");
+  if(getopt_get_double(getopt, "budget") > 0)
+    pl->rc = apriltag_resolution_create(getopt_get_double(getopt, "budget"));
+
+  pthread_t threads[3];
+  pthread_create(&threads[0], NULL, capture_thread, pl);
+  pthread_create(&threads[1], NULL, convert_thread, pl);
+  pthread_create(&threads[2], NULL, detect_thread, pl);
+
+  sprintf(displayString, "fps: -");
+  sprintf(stageString, "-");
+  int64_t window_utime = utime_now();
+  int window_frames = 0;
+
   while(1){
-    
-    clock_t t;
-    t = clock();
-    
-    cap >> src;                                               // Get a new frame from camera
-    if(found){
-      w = 3*src.size().width/5;                              // Reset width based on frame
-      h = 3*src.size().height/5;                             // Reset height based on frame
-      size = Size(w,h);                                      // Sets size based on width and height
-      resize(src,frame,size);                                // Resize to smaller image if tag found
-    }else{
-      frame = src;                                            // Keep standard image if no tag
-    }
-    //frame = RGB2YUV(frame);                                 // Just for comparison
-    frame = RGB2LAB(frame);                                   // Returns lab space
-    frame = alphaLAB(frame);                                  // Look at only a channel
-
-    // resize(frame,src,src.size());
-    
-    if(showGradient){
-      src = gradientEdges(src);                               // Show gradient for fun
-    }
-    
-    // determine time to convert
-    time_taken = ((double)(clock() - t))/(CLOCKS_PER_SEC/1000);
-    sprintf(convertTime, "Convert Time: %5.3fms", time_taken);
-    
-    pnm_t *pnm = mat2pnm(&frame);
-    image_u8_t *im = pnm_to_image_u8(pnm);                    // Convert pnm to gray image_u8
-    if (im == NULL) {                                         // Error - no image created from pnm
-      std::cout << "Error, not a proper pnm" << std::endl;
-      return -1;
+
+    frame_t *f;
+    if(!pl->detected.pop(&f)){
+      if(waitKey(1) >= 0) break;                              // Keep the window responsive
+      continue;
     }
+    int64_t t0 = utime_now();
+    Mat &src = f->src;
 
     /*** Start from origional Apriltags from apriltag_demo.c ***/
     
     int hamm_hist[hamm_hist_max];
     memset(hamm_hist, 0, sizeof(hamm_hist));
-    zarray_t *detections = apriltag_detector_detect(td, im);
     
-    for (int i = 0; i < zarray_size(detections); i++) {
+    for (int i = 0; i < zarray_size(f->detections); i++) {
       
       apriltag_detection_t *det;
-      zarray_get(detections, i, &det);
-      sprintf(locationString, "Tag Center: (%f,%f)", det->c[0], det->c[1]);
+      zarray_get(f->detections, i, &det);
+      sprintf(locationString, "Tag Center: (%f,%f)", det->c[0] / f->scale, det->c[1] / f->scale);
       sprintf(detectString, "detection %2d: id (%2dx%2d)-%-4d, hamming %d, goodness %5.3f, margin %5.3f\n",
               i+1, det->family->d*det->family->d, det->family->h, det->id, det->hamming, det->goodness, det->decision_margin);
       
@@ -121,57 +666,45 @@ int main(){
       
       // draws a vertical rectangle around tag, not ideal, but easy to implement
       // det->p[corner][positon], counter clockwise
-      Point pt1 = Point(det->p[0][0], det->p[0][1]);
-      Point pt2 = Point(det->p[2][0], det->p[2][1]);
-      
-      // If tag found flag, scale to image size
-      if(found){
-        Size s = src.size();
-        pt1 = Point((det->p[0][0]/w) * s.width, (det->p[0][1]/h) * s.height);
-        pt2 = Point((det->p[2][0]/w) * s.width, (det->p[2][1]/h) * s.height);
-      }
+      // (detections are in the resized frame's pixels)
+      Point pt1 = Point(det->p[0][0] / f->scale, det->p[0][1] / f->scale);
+      Point pt2 = Point(det->p[2][0] / f->scale, det->p[2][1] / f->scale);
       cv::rectangle(src, pt1, pt2, cvScalar(102,255,0));
-      
-      apriltag_detection_destroy(det);
     }
     
-    if(zarray_size(detections) < 1){
-      found = false;
+    if(zarray_size(f->detections) < 1){
       sprintf(detectString, "No tag detected");
       sprintf(locationString, "No tag detected");
-    }else{
-      found = true;
     }
     
-    zarray_destroy(detections);
-    image_u8_destroy(im);
-    
-    t = clock() - t;
-    time_taken = ((double)t)/(CLOCKS_PER_SEC/1000);
-    //printf("ms to render: %5.3f\n", time_taken);
-    
-    if (!quiet) {
-      //timeprofile_display(td->tp);
-      totalFPS += (1000.0/time_taken);
-      count += 1.0;
-      if(count > 150.0){
-        totalFPS = 0.0;
-        count = 0.0;
-      }
-      sprintf(displayString, "fps: %2.2Lf, nquads: %d",totalFPS/count, td->nquads);
-      //std::cout << displayString;
+    // capture to display, including time spent waiting in queues
+    double latency = (t0 - f->capture_utime) / 1.0E3;
+
+    // throughput and stage occupancy, averaged over about a second
+    window_frames++;
+    if(t0 - window_utime > 1000000){
+      stage_stats *stages[] = { &pl->capture_stats, &pl->convert_stats,
+                                &pl->detect_stats, &pl->output_stats };
+      int pos = 0;
+      for(int i = 0; i < 4; i++)
+        pos += sprintf(&stageString[pos], "%s %3.0f%% ", stages[i]->name, 100*stages[i]->occupancy());
+      sprintf(&stageString[pos], "dropped %" PRIu64, pl->captured.ndropped());
+
+      sprintf(displayString, "fps: %2.2f, nquads: %d, tracks: %d, scale: %.2f", window_frames * 1.0E6 / (t0 - window_utime), f->nquads, f->ntracks, f->scale);
+      window_utime = t0;
+      window_frames = 0;
     }
-    
-    //for (int i = 0; i < hamm_hist_max; i++)
-      //printf("%5d", hamm_hist[i]);
 
-    sprintf(renderTime, "Render: %5.3fms", time_taken);
-    sprintf(imgSize, "%dx%d", frame.cols, frame.rows);
+    sprintf(renderTime, "Detect: %5.3fms Latency: %5.3fms", f->detect_ms, latency);
+    sprintf(convertTime, "Convert Time: %5.3fms", f->convert_ms);
+    sprintf(imgSize, "%dx%d", f->w, f->h);
     sprintf(outputString, "%s %s %s", renderTime, convertTime, imgSize);
     printf("%s %s\r", locationString, outputString);
     
     if (quiet) {
-      printf("%12.3f", timeprofile_total_utime(td->tp) / 1.0E3);
+      printf("%12.3f", f->detect_ms);
+    } else {
+      printf(" %s", stageString);
     }
     
     printf("\n");
@@ -182,7 +715,7 @@ int main(){
     putText(src, displayString, cvPoint(30,30),
             FONT_HERSHEY_COMPLEX_SMALL, 0.8, cvScalar(200,200,250), 1, CV_AA);
     
-    // displays render time, convert time, and image size
+    // displays detect time, latency, convert time, and image size
     putText(src, outputString, cvPoint(30,50),
             FONT_HERSHEY_COMPLEX_SMALL, 0.8, cvScalar(200,200,250), 1, CV_AA);
     
@@ -194,15 +727,39 @@ int main(){
     // Displays tag location (if any)
     putText(src, locationString, cvPoint(30,90),
             FONT_HERSHEY_COMPLEX_SMALL, 0.8, cvScalar(150,150,250), 1, CV_AA);
+
+    // Displays how busy each stage is
+    putText(src, stageString, cvPoint(30,110),
+            FONT_HERSHEY_COMPLEX_SMALL, 0.8, cvScalar(150,150,250), 1, CV_AA);
     
     imshow("Display Apriltags", src);
+
+    frame_destroy(f);
+    __atomic_sub_fetch(&pl->inflight, 1, __ATOMIC_ACQ_REL);
+    pl->output_stats.add(t0);
     
-    if(waitKey(30) >= 0) break;
+    if(waitKey(1) >= 0) break;
   }
+
+  __atomic_store_n(&pl->running, 0, __ATOMIC_RELEASE);
+  for(int i = 0; i < 3; i++)
+    pthread_join(threads[i], NULL);
+
+  frame_t *f;
+  frame_destroy(pl->captured.take());
+  while(pl->converted.pop(&f))
+    frame_destroy(f);
+  while(pl->detected.pop(&f))
+    frame_destroy(f);
+  if(pl->rc)
+    apriltag_resolution_destroy(pl->rc);
+  apriltag_tracker_destroy(pl->tt);
+  delete pl;
   
   /* deallocate apriltag constructs */
   apriltag_detector_destroy(td);
   tag36h11_destroy(tf);
+  getopt_destroy(getopt);
 
   return 0;
 }
@@ -0,0 +1,134 @@
+/**
+ * Small building blocks for running the realtime loop as a pipeline
+ * of threads: a bounded single-producer/single-consumer queue, a
+ * latest-value mailbox, and per-stage occupancy counters.
+ *
+ * All of them are lock-free; a consumer that finds nothing to do
+ * backs off with pipeline_idle() rather than blocking.
+ */
+
+#ifndef _PIPELINE_HPP
+#define _PIPELINE_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../apriltags/common/time_util.h"
+
+/**
+ * Bounded queue with exactly one producer thread and one consumer
+ * thread. head and tail count forever; the slot is their value
+ * modulo the capacity.
+ */
+template <typename T>
+class spsc_queue {
+public:
+  spsc_queue(unsigned capacity) : cap(capacity), head(0), tail(0) {
+    buf = new T[capacity];
+  }
+  ~spsc_queue() { delete[] buf; }
+
+  // Returns false (and leaves v with the caller) if the queue is full.
+  bool push(const T &v) {
+    unsigned t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    if (t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) == cap)
+      return false;
+    buf[t % cap] = v;
+    __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Returns false if the queue is empty.
+  bool pop(T *v) {
+    unsigned h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    if (h == __atomic_load_n(&tail, __ATOMIC_ACQUIRE))
+      return false;
+    *v = buf[h % cap];
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Approximate when called from a third thread.
+  unsigned size() {
+    return __atomic_load_n(&tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  }
+
+private:
+  spsc_queue(const spsc_queue &);
+  spsc_queue &operator=(const spsc_queue &);
+
+  T *buf;
+  unsigned cap;
+  unsigned head, tail;
+};
+
+/**
+ * Holds only the most recent value posted. Posting over a value
+ * nobody took returns the old one so the producer can free it
+ * (it was a stale frame); taking empties the mailbox.
+ */
+template <typename T>
+class mailbox {
+public:
+  mailbox() : slot(NULL), dropped(0) {}
+
+  T *post(T *v) {
+    T *old = __atomic_exchange_n(&slot, v, __ATOMIC_ACQ_REL);
+    if (old != NULL)
+      __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    return old;
+  }
+
+  T *take() {
+    return __atomic_exchange_n(&slot, (T*) NULL, __ATOMIC_ACQ_REL);
+  }
+
+  uint64_t ndropped() { return __atomic_load_n(&dropped, __ATOMIC_RELAXED); }
+
+private:
+  T *slot;
+  uint64_t dropped;
+};
+
+/**
+ * How busy a stage is: accumulated time spent working and the number
+ * of frames it handled. occupancy() reports the busy fraction of the
+ * wall time since the previous call, so a stage near 1.0 is the one
+ * limiting throughput.
+ */
+struct stage_stats {
+  const char *name;
+  uint64_t busy_utime;
+  uint64_t frames;
+
+  // owned by whoever calls occupancy() (one thread only)
+  uint64_t last_busy_utime;
+  int64_t last_utime;
+
+  stage_stats(const char *n) : name(n), busy_utime(0), frames(0),
+                               last_busy_utime(0), last_utime(utime_now()) {}
+
+  void add(int64_t t0) {
+    __atomic_add_fetch(&busy_utime, utime_now() - t0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&frames, 1, __ATOMIC_RELAXED);
+  }
+
+  double occupancy() {
+    uint64_t busy = __atomic_load_n(&busy_utime, __ATOMIC_RELAXED);
+    int64_t now = utime_now();
+    double occ = now > last_utime ? (double) (busy - last_busy_utime) / (now - last_utime) : 0;
+    last_busy_utime = busy;
+    last_utime = now;
+    return occ;
+  }
+};
+
+/**
+ * Back-off for a stage with nothing to do.
+ */
+static inline void pipeline_idle() {
+  usleep(500);
+}
+
+#endif
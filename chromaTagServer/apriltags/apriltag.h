@@ -47,10 +47,18 @@ extern "C" {
 
 #define APRILTAG_TASKS_PER_THREAD_TARGET 10
 
+// values for apriltag_quad_thresh_params.thresh_method
+#define APRILTAG_THRESH_TILE 0
+#define APRILTAG_THRESH_MEAN 1
+
 struct quad
 {
     float p[4][2]; // corners
 
+    // worst mean squared error of the lines fit to its edges (in the
+    // pixels of the image it was found in), or 0 if not known.
+    float line_mse;
+
     // H: tag coordinates ([-1,1] at the black corners) to pixels
     // Hinv: pixels to tag
     matd_t *H, *Hinv;
@@ -116,6 +124,23 @@ struct apriltag_quad_thresh_params
 
     // should the thresholded image be deglitched? This
     int deglitch;
+
+    // How to binarize the image. APRILTAG_THRESH_TILE uses the
+    // min/max of the surrounding 16x16 tiles (and min_white_black_diff).
+    // APRILTAG_THRESH_MEAN compares the 3x3 mean around each pixel
+    // with the mean of the surrounding (2*mean_radius+1)^2 window,
+    // less mean_offset. It is less sensitive to single noisy pixels,
+    // and makes a separate blur (quad_sigma) unnecessary. The window
+    // must be wider than a tag's black border.
+    int thresh_method;
+    int mean_radius;
+    int mean_offset;
+
+    // When non-zero (the default), the passes after thresholding
+    // only visit the tiles the threshold found not to be flat, and
+    // the tiles around them; no other pixel can be an edge. Zero
+    // visits every pixel, for the same result more slowly.
+    int skip_flat_tiles;
 };
 
 // Represents a detector object. Upon creating a detector, all fields
@@ -166,6 +191,48 @@ struct apriltag_detector
 
     struct apriltag_quad_thresh_params qtp;
 
+    // When greater than 1, quads are searched for on an image
+    // pyramid: the (decimated) image, then pyramid_levels-1 more
+    // levels, each half the size of the one before. The coarsest
+    // level is searched whole. Clusters on it too small to reliably
+    // fit and decode are searched for again, in a window around
+    // them, one level finer, and so on. Large tags cost little more
+    // than on the coarsest level, yet small tags are still found at
+    // full (quad_decimate) resolution. The corners of all quads are
+    // then refined against the original image. This ignores
+    // incremental.
+    int pyramid_levels;
+
+    // When non-zero, successive images are assumed to come from a
+    // fixed camera. The quad detector compares each 16x16 tile of
+    // the (decimated, blurred) image with the last frame in which it
+    // was searched, re-searches only the tiles that changed (and a
+    // margin around them), and reuses the previous frame's quads
+    // everywhere else. A tile has changed when its mean absolute
+    // pixel difference exceeds change_threshold. The whole image is
+    // searched every refresh_interval frames (0: only when the image
+    // size changes).
+    int incremental;
+    int refresh_interval;
+    float change_threshold;
+
+    // Bound the time spent decoding when clutter produces many
+    // candidate quads. When any of these is set, quads are scored
+    // cheaply (contrast across their edges, size, and line fit) and
+    // decoded best first, and decoding stops after max_decode_quads
+    // quads, or once decode_budget_us microseconds have passed since
+    // it began, or once every id in expected_ids (nexpected_ids of
+    // them, in any family) has been decoded. Zero means no limit.
+    // Quads that are not decoded are dropped, so tags can be missed
+    // when a limit is hit. A quad that has started decoding is always
+    // finished, so the time can run over by about one quad per thread
+    // (much more with refine_pose). expected_ids is owned by the
+    // caller.
+    int max_decode_quads;
+    int decode_budget_us;
+    const int *expected_ids;
+    int nexpected_ids;
+
     ///////////////////////////////////////////////////////////////
     // Statistics relating to last processed frame
     timeprofile_t *tp;
@@ -174,6 +241,9 @@ struct apriltag_detector
     uint32_t nsegments;
     uint32_t nquads;
 
+    // how many quads the last decode stage actually decoded.
+    uint32_t ndecoded;
+
     ///////////////////////////////////////////////////////////////
     // Internal variables below
 
@@ -182,11 +252,15 @@ struct apriltag_detector
     // tag family passed into the constructor.
     zarray_t *tag_families;
 
-    // Used to manage multi-threading.
+    // Used to manage multi-threading. workerpool_get_busy_utime()
+    // reports how long each thread worked on the last frame.
     workerpool_t *wp;
 
     // Used for thread safety.
     pthread_mutex_t mutex;
+
+    // State kept between frames by the incremental quad detector.
+    struct apriltag_quad_cache *quad_cache;
 };
 
 // Represents the detection of a tag. These are returned to the user
@@ -255,6 +329,118 @@ void apriltag_detector_destroy(apriltag_detector_t *td);
 // apriltag_detection_t*.
 zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig);
 
+// A rectangle of pixels, [x, x+width) x [y, y+height).
+typedef struct apriltag_roi apriltag_roi_t;
+struct apriltag_roi
+{
+    int x, y, width, height;
+};
+
+// Like apriltag_detector_detect, but only search for tags inside the
+// nrects given rectangles (e.g., around where tags were last seen).
+// Rectangles are clipped to the image and overlapping ones are
+// merged. Quads are found within each rectangle using all of td's
+// settings, then decoded at full resolution; detections are in
+// im_orig's coordinates. A tag must lie entirely inside a rectangle
+// to be found. Never uses or updates td's incremental quad cache
+// (unless a rectangle covers the whole image).
+zarray_t *apriltag_detector_detect_rois(apriltag_detector_t *td, image_u8_t *im_orig,
+                                        const apriltag_roi_t *rects, int nrects);
+
+// The stages of apriltag_detector_detect, for callers that want to
+// time them separately, decode quads that came from somewhere else
+// (e.g., a tracker), or reuse their intermediate arrays across
+// frames. apriltag_detector_detect is equivalent to (less its debug
+// output):
+//
+//     zarray_t *quads = zarray_create(sizeof(struct quad));
+//     zarray_t *dets = zarray_create(sizeof(apriltag_detection_t*));
+//     apriltag_detector_detect_quads(td, im, quads);
+//     apriltag_detector_decode_quads(td, im, quads, dets);
+//     apriltag_detector_reconcile(td, dets);
+//     apriltag_quads_destroy(quads);
+//
+// All arrays are owned by the caller. The stages share td's worker
+// pool and time profile, so two stages must not run on the same
+// detector at the same time; use the _ctx versions below, with a
+// context per thread, to overlap stages of successive frames.
+
+// Find candidate quads in im_orig and append them (in im_orig's
+// pixel coordinates) to quads, an array of struct quad. Starts a new
+// time profile. im_orig is not modified.
+void apriltag_detector_detect_quads(apriltag_detector_t *td, image_u8_t *im_orig, zarray_t *quads);
+
+// Decode each quad against every tag family and append the
+// resulting apriltag_detection_t* to detections. Only p[] needs to
+// be filled in for injected quads; H and Hinv must be NULL or
+// matrices owned by the quad, and are (re)computed here.
+void apriltag_detector_decode_quads(apriltag_detector_t *td, image_u8_t *im_orig,
+                                    zarray_t *quads, zarray_t *detections);
+
+// Remove overlapping detections of the same tag (keeping the best
+// one) and sort the rest.
+void apriltag_detector_reconcile(apriltag_detector_t *td, zarray_t *detections);
+
+// Free the homographies held by an array of struct quad and empty it
+// (clear), or also free the array itself (destroy).
+void apriltag_quads_clear(zarray_t *quads);
+void apriltag_quads_destroy(zarray_t *quads);
+
+// The state of a detection in progress that the calls above keep in
+// the detector: the worker pool, time profile, statistics, and the
+// incremental quad cache. Calls given a context keep it there
+// instead, so one detector (with its families and their decode
+// tables) can serve several threads at once, each with a context of
+// its own. td is only read by those calls, so its parameters must not
+// change (nor families be added) while any are in progress. A
+// context also keeps the incremental quad cache for one camera, so
+// use one per camera.
+typedef struct apriltag_detect_context apriltag_detect_context_t;
+struct apriltag_detect_context
+{
+    // runs this context's tasks; nthreads threads including the
+    // calling one (1: everything runs on the calling thread).
+    workerpool_t *wp;
+
+    ///////////////////////////////////////////////////////////////
+    // Statistics relating to the last call made with this context
+    timeprofile_t *tp;
+
+    uint32_t nedges;
+    uint32_t nsegments;
+    uint32_t nquads;
+    uint32_t ndecoded;
+
+    ///////////////////////////////////////////////////////////////
+    // Internal variables below
+
+    struct apriltag_quad_cache *quad_cache;
+};
+
+apriltag_detect_context_t *apriltag_detect_context_create(int nthreads);
+void apriltag_detect_context_destroy(apriltag_detect_context_t *ctx);
+
+// As the calls above, using ctx for the state of the detection.
+zarray_t *apriltag_detector_detect_ctx(const apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                       image_u8_t *im_orig);
+zarray_t *apriltag_detector_detect_rois_ctx(const apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                            image_u8_t *im_orig, const apriltag_roi_t *rects, int nrects);
+void apriltag_detector_detect_quads_ctx(const apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                        image_u8_t *im_orig, zarray_t *quads);
+void apriltag_detector_decode_quads_ctx(const apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                        image_u8_t *im_orig, zarray_t *quads, zarray_t *detections);
+void apriltag_detector_reconcile_ctx(const apriltag_detector_t *td, apriltag_detect_context_t *ctx,
+                                     zarray_t *detections);
+
+// Move the corners of quad onto the nearby edges of a tag in im,
+// searching up to range pixels to either side of each edge. Useful
+// to follow a tag from a prediction of where it is, without
+// searching for quads. Returns the largest RMS distance (in pixels)
+// of an edge's points from its fitted line; or -1 if an edge was
+// mostly not found or a corner could not be placed, in which case
+// quad may be only partly updated.
+double apriltag_quad_refine_edges(image_u8_t *im, struct quad *quad, double range);
+
 // Call this method on each of the tags returned by apriltag_detector_detect
 void apriltag_detection_destroy(apriltag_detection_t *det);
 
@@ -0,0 +1,400 @@
+/* (C) 2013-2014, The Regents of The University of Michigan
+All rights reserved.
+
+This software may be available under alternative licensing
+terms. Contact Edwin Olson, ebolson@umich.edu, for more information.
+
+   Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apriltag_tracker.h"
+#include "common/homography.h"
+#include "common/math_util.h"
+#include "common/matd.h"
+#include "common/zarray.h"
+
+// XXX Tunable. Gains of the alpha-beta filter on each corner
+// coordinate: how far to move the position, and the velocity, toward
+// what was measured. Detected corners are accurate to well under a
+// pixel, so the position mostly follows the measurement; the
+// velocity is smoothed more to ride out jitter.
+#define TRACKER_ALPHA 0.85
+#define TRACKER_BETA 0.5
+
+apriltag_tracker_t *apriltag_tracker_create(apriltag_detector_t *td)
+{
+    apriltag_tracker_t *tt = calloc(1, sizeof(apriltag_tracker_t));
+
+    tt->discovery_interval = 30;
+    tt->max_missed = 3;
+    tt->roi_margin = 0.25;
+    tt->decode_interval = 5;
+    tt->max_residual = 0.3;
+
+    tt->td = td;
+    tt->tracks = zarray_create(sizeof(apriltag_track_t));
+
+    return tt;
+}
+
+void apriltag_tracker_destroy(apriltag_tracker_t *tt)
+{
+    if (tt == NULL)
+        return;
+
+    zarray_destroy(tt->tracks);
+    free(tt);
+}
+
+void apriltag_tracker_reset(apriltag_tracker_t *tt)
+{
+    zarray_clear(tt->tracks);
+    tt->frames_since_discovery = 0;
+    tt->lost = 0;
+}
+
+void apriltag_tracker_rescale(apriltag_tracker_t *tt, double factor)
+{
+    for (int i = 0; i < zarray_size(tt->tracks); i++) {
+        apriltag_track_t *t;
+        zarray_get_volatile(tt->tracks, i, &t);
+
+        for (int k = 0; k < 4; k++) {
+            for (int d = 0; d < 2; d++) {
+                t->p[k][d] *= factor;
+                t->v[k][d] *= factor;
+            }
+        }
+    }
+}
+
+// where the track's corners should be in the next frame.
+static void track_predict(const apriltag_track_t *t, double pred[4][2])
+{
+    for (int k = 0; k < 4; k++) {
+        pred[k][0] = t->p[k][0] + t->v[k][0];
+        pred[k][1] = t->p[k][1] + t->v[k][1];
+    }
+}
+
+static double track_speed(const apriltag_track_t *t)
+{
+    double speed = 0;
+    for (int k = 0; k < 4; k++)
+        speed = fmax(speed, fmax(fabs(t->v[k][0]), fabs(t->v[k][1])));
+    return speed;
+}
+
+static apriltag_roi_t track_roi(const apriltag_tracker_t *tt, const apriltag_track_t *t)
+{
+    double pred[4][2];
+    track_predict(t, pred);
+
+    double xmin = pred[0][0], xmax = xmin, ymin = pred[0][1], ymax = ymin;
+
+    for (int k = 0; k < 4; k++) {
+        xmin = fmin(xmin, pred[k][0]);
+        xmax = fmax(xmax, pred[k][0]);
+        ymin = fmin(ymin, pred[k][1]);
+        ymax = fmax(ymax, pred[k][1]);
+    }
+
+    double speed = track_speed(t);
+
+    // a track that is coasting is less certain the longer it has
+    // gone unseen.
+    double grow = (1 + t->missed) * (tt->roi_margin * fmax(xmax - xmin, ymax - ymin) + speed);
+
+    apriltag_roi_t roi;
+    roi.x = (int) floor(xmin - grow);
+    roi.y = (int) floor(ymin - grow);
+    roi.width = (int) ceil(xmax + grow) - roi.x + 1;
+    roi.height = (int) ceil(ymax + grow) - roi.y + 1;
+    return roi;
+}
+
+// A detection of t's tag with corners p, repeating the scores of its
+// last decode.
+static apriltag_detection_t *track_detection(const apriltag_track_t *t, float p[4][2])
+{
+    apriltag_detection_t *det = calloc(1, sizeof(apriltag_detection_t));
+
+    det->family = t->family;
+    det->id = t->id;
+    det->hamming = t->hamming;
+    det->goodness = t->goodness;
+    det->decision_margin = t->decision_margin;
+
+    zarray_t *correspondences = zarray_create(sizeof(float[4]));
+
+    for (int i = 0; i < 4; i++) {
+        float corr[4];
+
+        corr[0] = (i==0 || i==3) ? -1 : 1;
+        corr[1] = (i==0 || i==1) ? -1 : 1;
+        corr[2] = p[i][0];
+        corr[3] = p[i][1];
+
+        zarray_add(correspondences, &corr);
+
+        det->p[i][0] = p[i][0];
+        det->p[i][1] = p[i][1];
+    }
+
+    det->H = homography_compute(correspondences, HOMOGRAPHY_COMPUTE_FLAG_SVD);
+    homography_project(det->H, 0, 0, &det->c[0], &det->c[1]);
+
+    zarray_destroy(correspondences);
+    return det;
+}
+
+// Try to follow t's tag into this frame by its edges. On success,
+// adds its detection and returns 1.
+static int track_follow_edges(apriltag_tracker_t *tt, apriltag_track_t *t, image_u8_t *im,
+                              zarray_t *detections)
+{
+    double pred[4][2];
+    track_predict(t, pred);
+
+    struct quad q = { .H = NULL, .Hinv = NULL };
+    for (int k = 0; k < 4; k++) {
+        q.p[k][0] = pred[k][0];
+        q.p[k][1] = pred[k][1];
+    }
+
+    // XXX Tunable. How far from the predicted edges to look: the
+    // prediction is usually off by no more than the last motion.
+    double range = 2 + track_speed(t);
+
+    double residual = apriltag_quad_refine_edges(im, &q, range);
+    if (residual < 0 || residual > tt->max_residual) {
+        tt->nedges_failed++;
+        return 0;
+    }
+
+    apriltag_detection_t *det = NULL;
+
+    if (t->since_decode + 1 >= tt->decode_interval) {
+        // confirm that it's still the same tag.
+        zarray_t *quads = zarray_create(sizeof(struct quad));
+        zarray_t *dets = zarray_create(sizeof(apriltag_detection_t*));
+        zarray_add(quads, &q);
+
+        if (tt->ctx)
+            apriltag_detector_decode_quads_ctx(tt->td, tt->ctx, im, quads, dets);
+        else
+            apriltag_detector_decode_quads(tt->td, im, quads, dets);
+
+        for (int i = 0; i < zarray_size(dets); i++) {
+            apriltag_detection_t *d;
+            zarray_get(dets, i, &d);
+
+            if (det == NULL && d->family == t->family && d->id == t->id)
+                det = d;
+            else
+                apriltag_detection_destroy(d);
+        }
+
+        zarray_destroy(dets);
+        apriltag_quads_destroy(quads);
+
+        if (det == NULL) {
+            tt->nedges_failed++;
+            return 0;
+        }
+
+        t->followed = 0;
+    } else {
+        det = track_detection(t, q.p);
+        t->followed = 1;
+    }
+
+    zarray_add(detections, &det);
+    tt->nedges++;
+    return 1;
+}
+
+zarray_t *apriltag_tracker_update(apriltag_tracker_t *tt, image_u8_t *im)
+{
+    int ntracks = zarray_size(tt->tracks);
+
+    int full = ntracks == 0 || tt->lost ||
+        (tt->discovery_interval > 0 && tt->frames_since_discovery + 1 >= tt->discovery_interval);
+
+    zarray_t *detections;
+
+    if (full) {
+        if (tt->ctx)
+            detections = apriltag_detector_detect_ctx(tt->td, tt->ctx, im);
+        else
+            detections = apriltag_detector_detect(tt->td, im);
+        tt->frames_since_discovery = 0;
+        tt->nfull++;
+    } else {
+        detections = zarray_create(sizeof(apriltag_detection_t*));
+
+        apriltag_roi_t *rois = malloc(sizeof(apriltag_roi_t) * (ntracks + 1));
+        int nrois = 0;
+
+        for (int i = 0; i < ntracks; i++) {
+            apriltag_track_t *t;
+            zarray_get_volatile(tt->tracks, i, &t);
+
+            if (tt->track_edges && t->missed == 0 &&
+                track_follow_edges(tt, t, im, detections))
+                continue;
+
+            rois[nrois++] = track_roi(tt, t);
+        }
+
+        if (nrois > 0) {
+            zarray_t *found;
+            if (tt->ctx)
+                found = apriltag_detector_detect_rois_ctx(tt->td, tt->ctx, im, rois, nrois);
+            else
+                found = apriltag_detector_detect_rois(tt->td, im, rois, nrois);
+            zarray_add_all(detections, found);
+            zarray_destroy(found);
+        }
+        free(rois);
+
+        // a window may also contain a tag that was followed by its
+        // edges.
+        if (tt->ctx)
+            apriltag_detector_reconcile_ctx(tt->td, tt->ctx, detections);
+        else
+            apriltag_detector_reconcile(tt->td, detections);
+        tt->frames_since_discovery++;
+    }
+
+    tt->nframes++;
+    tt->lost = 0;
+
+    int ndets = zarray_size(detections);
+    int *used = calloc(ndets + 1, sizeof(int));
+
+    // update each track with the detection of its tag nearest to
+    // where it was predicted (the same id may be detected more than
+    // once).
+    for (int i = 0; i < zarray_size(tt->tracks); i++) {
+        apriltag_track_t *t;
+        zarray_get_volatile(tt->tracks, i, &t);
+
+        int followed = t->followed;
+        t->followed = 0;
+
+        double pred[4][2];
+        track_predict(t, pred);
+
+        double cx = (pred[0][0] + pred[1][0] + pred[2][0] + pred[3][0]) / 4;
+        double cy = (pred[0][1] + pred[1][1] + pred[2][1] + pred[3][1]) / 4;
+
+        int best = -1;
+        double bestdist = HUGE_VAL;
+
+        for (int j = 0; j < ndets; j++) {
+            apriltag_detection_t *det;
+            zarray_get(detections, j, &det);
+
+            if (det->family != t->family || det->id != t->id)
+                continue;
+
+            double dist = sq(det->c[0] - cx) + sq(det->c[1] - cy);
+            if (dist < bestdist) {
+                best = j;
+                bestdist = dist;
+            }
+        }
+
+        t->age++;
+
+        if (best < 0) {
+            // coast on the prediction.
+            memcpy(t->p, pred, sizeof(t->p));
+            t->missed++;
+
+            if (t->missed > tt->max_missed) {
+                zarray_remove_index(tt->tracks, i, 0);
+                i--;
+                tt->lost = 1;
+            }
+            continue;
+        }
+
+        apriltag_detection_t *det;
+        zarray_get(detections, best, &det);
+        used[best] = 1;
+
+        for (int k = 0; k < 4; k++) {
+            for (int d = 0; d < 2; d++) {
+                double r = det->p[k][d] - pred[k][d];
+                t->p[k][d] = pred[k][d] + TRACKER_ALPHA * r;
+                t->v[k][d] += TRACKER_BETA * r;
+            }
+        }
+        t->missed = 0;
+
+        if (followed) {
+            t->since_decode++;
+        } else {
+            t->hamming = det->hamming;
+            t->goodness = det->goodness;
+            t->decision_margin = det->decision_margin;
+            t->since_decode = 0;
+        }
+    }
+
+    // start tracks for tags seen for the first time.
+    for (int j = 0; j < ndets; j++) {
+        if (used[j])
+            continue;
+
+        apriltag_detection_t *det;
+        zarray_get(detections, j, &det);
+
+        int known = 0;
+        for (int i = 0; i < zarray_size(tt->tracks) && !known; i++) {
+            apriltag_track_t *t;
+            zarray_get_volatile(tt->tracks, i, &t);
+            known = t->family == det->family && t->id == det->id;
+        }
+
+        if (known)
+            continue;
+
+        apriltag_track_t t = { .family = det->family, .id = det->id,
+                               .hamming = det->hamming, .goodness = det->goodness,
+                               .decision_margin = det->decision_margin };
+        memcpy(t.p, det->p, sizeof(t.p));
+        zarray_add(tt->tracks, &t);
+    }
+
+    free(used);
+    return detections;
+}
@@ -0,0 +1,174 @@
+/* (C) 2013-2014, The Regents of The University of Michigan
+All rights reserved.
+
+This software may be available under alternative licensing
+terms. Contact Edwin Olson, ebolson@umich.edu, for more information.
+
+   Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+ */
+
+#ifndef _APRILTAG_TRACKER_H
+#define _APRILTAG_TRACKER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "apriltag.h"
+
+// Follows tags from frame to frame so that most frames only need to
+// be searched near where the tags are expected to be.
+//
+// Each track is one tag, keyed by (family, id). It keeps a
+// constant-velocity estimate of the tag's four corners, updated with
+// an alpha-beta filter (a steady-state Kalman filter). For each frame
+// the tracker predicts where every tracked tag will be and searches
+// only windows around those predictions
+// (apriltag_detector_detect_rois). A track that is missed coasts on
+// its prediction, in a growing window, for up to max_missed frames.
+// The whole frame is searched for new tags when there are no tracks,
+// after a track is dropped, and at least every discovery_interval
+// frames.
+//
+// With track_edges, a tracked tag is instead followed by its edges:
+// starting from the predicted corners, the four edges are refit to
+// the image gradient nearby (apriltag_quad_refine_edges) and
+// intersected for the new corners, with no thresholding or
+// segmentation at all. The tag is decoded again every
+// decode_interval frames to confirm its identity; in between, its
+// detection repeats the last decode's id and scores. When an edge
+// can't be found, fits worse than max_residual, or the decode
+// disagrees, the tag falls back to a window search for that frame.
+//
+// Tags that are not tracked can only be found by a full-frame
+// search, so a tag entering the view may take up to
+// discovery_interval frames to appear.
+
+typedef struct apriltag_track apriltag_track_t;
+struct apriltag_track
+{
+    apriltag_family_t *family;
+    int id;
+
+    // filtered corners, as of the last frame, and their velocity in
+    // pixels per frame.
+    double p[4][2];
+    double v[4][2];
+
+    // frames since the track was started, and consecutive frames it
+    // has not been detected in.
+    int age;
+    int missed;
+
+    // from the last time the tag was decoded, and how many frames
+    // ago that was.
+    int hamming;
+    float goodness;
+    float decision_margin;
+    int since_decode;
+
+    // set while this frame's detection of the tag came from
+    // following its edges, not from a decode.
+    int followed;
+};
+
+typedef struct apriltag_tracker apriltag_tracker_t;
+struct apriltag_tracker
+{
+    ///////////////////////////////////////////////////////////////
+    // User-configurable parameters.
+
+    // Search the whole frame at least this often (in frames).
+    int discovery_interval;
+
+    // Drop a track after this many consecutive frames without a
+    // detection.
+    int max_missed;
+
+    // Each search window is the predicted bounding box of the tag,
+    // grown on every side by this fraction of the tag's size plus
+    // the distance its corners moved in the last frame (times one
+    // plus the number of frames it has been missed).
+    double roi_margin;
+
+    // Follow tracked tags by their edges (see above), decoding them
+    // every decode_interval frames, while the worst edge fits to
+    // within max_residual pixels.
+    int track_edges;
+    int decode_interval;
+    double max_residual;
+
+    ///////////////////////////////////////////////////////////////
+    // State
+
+    apriltag_detector_t *td;
+
+    // When set (by the caller, who still owns it), detection keeps
+    // its state in ctx instead of td, so that the trackers of several
+    // cameras can share one detector, even from several threads (see
+    // apriltag_detect_context_t).
+    apriltag_detect_context_t *ctx;
+
+    // apriltag_track_t, in the order they were started.
+    zarray_t *tracks;
+
+    int frames_since_discovery;
+
+    // set when a track was dropped, so that the next frame is
+    // searched in full.
+    int lost;
+
+    // Statistics: frames processed, how many were full-frame
+    // searches, and how many tags were followed by their edges
+    // (nedges) or had to be searched for in a window instead
+    // (nedges_failed).
+    int nframes;
+    int nfull;
+    int nedges;
+    int nedges_failed;
+};
+
+// td remains owned by the caller, and must outlive the tracker.
+apriltag_tracker_t *apriltag_tracker_create(apriltag_detector_t *td);
+void apriltag_tracker_destroy(apriltag_tracker_t *tt);
+
+// Forget all tracks; the next frame is searched in full.
+void apriltag_tracker_reset(apriltag_tracker_t *tt);
+
+// The next frames will be scaled by factor relative to the previous
+// ones (e.g., the caller changed the resolution it detects at): scale
+// the tracks to match.
+void apriltag_tracker_rescale(apriltag_tracker_t *tt, double factor);
+
+// Detect tags in the next frame of a sequence and update the tracks.
+// Returns the detections (an array of apriltag_detection_t*, owned by
+// the caller, as from apriltag_detector_detect).
+zarray_t *apriltag_tracker_update(apriltag_tracker_t *tt, image_u8_t *im);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
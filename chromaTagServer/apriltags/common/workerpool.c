@@ -29,74 +29,225 @@ of the authors and should not be interpreted as representing official policies,
 either expressed or implied, of the FreeBSD Project.
  */
 
-#define __USE_GNU
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <sched.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <inttypes.h>
 
 #include "workerpool.h"
 #include "timeprofile.h"
 
+// The pool is fork-join: workerpool_run hands out the added tasks to
+// nthreads participants (the calling thread plus nthreads-1 worker
+// threads) and returns once all of them have completed.
+//
+// Each participant owns a deque, which is just a range [lo, hi) of
+// indices into the task array, packed into one 64-bit word so that it
+// can be updated with a single compare-and-swap. The owner takes tasks
+// from the front; a participant whose deque is empty steals the back
+// half of someone else's. No locks are taken while there is work.
+//
+// Tasks added with workerpool_add_task_cost are first ranked by that
+// cost, most expensive first (ties, and runs without costs, keep the
+// order they were added in). The ranking is then dealt out
+// round-robin, so each participant starts with one of the nthreads
+// most expensive tasks and its deque runs from expensive to cheap;
+// steals take the cheap back half.
+//
+// Between runs, worker threads spin for a little while waiting for
+// the next run (runs come several times per frame) and then park on a
+// condition variable.
+
+// how many times does an idle worker poll for a new run before parking?
+#define WORKERPOOL_SPIN_ITERS 4000
+
+struct deque
+{
+    uint64_t range; // (hi << 32) | lo, indices into order[].
+    int64_t busy_utime; // time spent in tasks by this deque's owner
+    char pad[64 - 2*sizeof(uint64_t)]; // one deque per cache line
+};
+
 struct workerpool {
     int nthreads;
     zarray_t *tasks;
-    int taskspos;
 
-    pthread_t *threads;
-    int *status;
+    pthread_t *threads; // nthreads - 1 workers
+    struct deque *deques; // nthreads; deques[0] belongs to the caller of run.
+
+    int *order; // task indices, grouped by the participant they're dealt to.
+    struct ranked_task *rank; // scratch for sorting tasks by cost
+    int order_alloc; // capacity of order and rank
+    int has_costs; // were any tasks in this run added with a cost?
+
+    int remaining; // tasks not yet completed in the current run
+    int active; // workers inside participate
+    uint32_t epoch; // incremented to start each run
+    int quit;
 
     pthread_mutex_t mutex;
     pthread_cond_t startcond;   // used to signal the availability of work
-    pthread_cond_t endcond;     // used to signal completion of all work
-
-    int end_count; // how many threads are done?
+    int nsleepers; // workers parked on startcond
 };
 
 struct task
 {
     void (*f)(void *p);
     void *p;
+    double cost;
+};
+
+struct worker_arg
+{
+    workerpool_t *wp;
+    int idx;
 };
 
-void *worker_thread(void *p)
+static inline void cpu_relax(void)
 {
-    workerpool_t *wp = (workerpool_t*) p;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
 
-    int cnt = 0;
+static inline uint64_t range_pack(uint32_t lo, uint32_t hi)
+{
+    return ((uint64_t) hi << 32) | lo;
+}
+
+// take the task at the front of our own deque. returns -1 if empty.
+static int deque_pop(struct deque *dq)
+{
+    uint64_t r = __atomic_load_n(&dq->range, __ATOMIC_ACQUIRE);
 
     while (1) {
+        uint32_t lo = r, hi = r >> 32;
+        if (lo >= hi)
+            return -1;
+
+        if (__atomic_compare_exchange_n(&dq->range, &r, range_pack(lo + 1, hi), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return lo;
+    }
+}
+
+// steal the back half of someone's deque. Returns the first stolen
+// task; the rest go into our own (empty) deque. returns -1 if there
+// was nothing left to steal.
+static int deque_steal(workerpool_t *wp, int self)
+{
+    for (int k = 1; k < wp->nthreads; k++) {
+        struct deque *victim = &wp->deques[(self + k) % wp->nthreads];
+        uint64_t r = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+
+        while (1) {
+            uint32_t lo = r, hi = r >> 32;
+            if (lo >= hi)
+                break;
+
+            uint32_t mid = hi - (hi - lo + 1) / 2;
+
+            if (__atomic_compare_exchange_n(&victim->range, &r, range_pack(lo, mid), 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&wp->deques[self].range, range_pack(mid + 1, hi), __ATOMIC_RELEASE);
+                return mid;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// run tasks until there is nothing left that we can take.
+static void participate(workerpool_t *wp, int self)
+{
+    while (1) {
+        int idx = deque_pop(&wp->deques[self]);
+        if (idx < 0)
+            idx = deque_steal(wp, self);
+        if (idx < 0)
+            return;
+
         struct task *task;
+        zarray_get_volatile(wp->tasks, wp->order[idx], &task);
 
-        pthread_mutex_lock(&wp->mutex);
-        while (wp->taskspos == zarray_size(wp->tasks)) {
-            wp->end_count++;
-//          printf("%"PRId64" thread %d did %d\n", utime_now(), pthread_self(), cnt);
-            pthread_cond_broadcast(&wp->endcond);
-            pthread_cond_wait(&wp->startcond, &wp->mutex);
-            cnt = 0;
-//            printf("%"PRId64" thread %d awake\n", utime_now(), pthread_self());
+        int64_t t0 = utime_now();
+        task->f(task->p);
+        wp->deques[self].busy_utime += utime_now() - t0;
+
+        __atomic_sub_fetch(&wp->remaining, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void *worker_thread(void *p)
+{
+    struct worker_arg *arg = (struct worker_arg*) p;
+    workerpool_t *wp = arg->wp;
+    int self = arg->idx;
+    free(arg);
+
+    uint32_t seen = 0;
+
+    while (1) {
+        // wait for the next run: spin first, then park.
+        int spins = 0;
+        while (__atomic_load_n(&wp->epoch, __ATOMIC_ACQUIRE) == seen) {
+            if (++spins < WORKERPOOL_SPIN_ITERS) {
+                cpu_relax();
+                continue;
+            }
+
+            pthread_mutex_lock(&wp->mutex);
+            __atomic_add_fetch(&wp->nsleepers, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&wp->epoch, __ATOMIC_SEQ_CST) == seen)
+                pthread_cond_wait(&wp->startcond, &wp->mutex);
+            __atomic_sub_fetch(&wp->nsleepers, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&wp->mutex);
         }
 
-        zarray_get_volatile(wp->tasks, wp->taskspos, &task);
-        wp->taskspos++;
-        cnt++;
-        pthread_mutex_unlock(&wp->mutex);
-//        pthread_yield();
-        sched_yield();
+        seen = __atomic_load_n(&wp->epoch, __ATOMIC_ACQUIRE);
 
         // we've been asked to exit.
-        if (task->f == NULL)
+        if (__atomic_load_n(&wp->quit, __ATOMIC_ACQUIRE))
             return NULL;
 
-        task->f(task->p);
+        // join only a run that is dealt and not yet over. A worker
+        // slow to wake may find the run it was woken for has ended
+        // and the next one is being dealt; touching the deques then
+        // would lose tasks. workerpool_run doesn't return while any
+        // worker is active, and sets remaining only once it has dealt
+        // every deque, so a worker that counts itself active and then
+        // sees remaining > 0 has a whole run to itself.
+        __atomic_add_fetch(&wp->active, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&wp->remaining, __ATOMIC_SEQ_CST) > 0)
+            participate(wp, self);
+        __atomic_sub_fetch(&wp->active, 1, __ATOMIC_SEQ_CST);
     }
 
     return NULL;
 }
 
+// start a run (or ask the workers to quit): publish the new epoch and
+// wake anybody who has parked.
+static void wake_workers(workerpool_t *wp)
+{
+    __atomic_add_fetch(&wp->epoch, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&wp->nsleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&wp->mutex);
+        pthread_cond_broadcast(&wp->startcond);
+        pthread_mutex_unlock(&wp->mutex);
+    }
+}
+
 workerpool_t *workerpool_create(int nthreads)
 {
     assert(nthreads > 0);
@@ -105,15 +256,26 @@ workerpool_t *workerpool_create(int nthreads)
     wp->nthreads = nthreads;
     wp->tasks = zarray_create(sizeof(struct task));
 
+    void *deques;
+    if (posix_memalign(&deques, 64, nthreads * sizeof(struct deque))) {
+        perror("posix_memalign");
+        exit(-1);
+    }
+    memset(deques, 0, nthreads * sizeof(struct deque));
+    wp->deques = deques;
+
     if (nthreads > 1) {
         wp->threads = calloc(wp->nthreads, sizeof(pthread_t));
 
         pthread_mutex_init(&wp->mutex, NULL);
         pthread_cond_init(&wp->startcond, NULL);
-        pthread_cond_init(&wp->endcond, NULL);
 
-        for (int i = 0; i < nthreads; i++) {
-            int res = pthread_create(&wp->threads[i], NULL, worker_thread, wp);
+        for (int i = 1; i < nthreads; i++) {
+            struct worker_arg *arg = malloc(sizeof(struct worker_arg));
+            arg->wp = wp;
+            arg->idx = i;
+
+            int res = pthread_create(&wp->threads[i], NULL, worker_thread, arg);
             if (res != 0) {
                 perror("pthread_create");
                 exit(-1);
@@ -131,22 +293,20 @@ void workerpool_destroy(workerpool_t *wp)
 
     // force all worker threads to exit.
     if (wp->nthreads > 1) {
-        for (int i = 0; i < wp->nthreads; i++)
-            workerpool_add_task(wp, NULL, NULL);
+        __atomic_store_n(&wp->quit, 1, __ATOMIC_RELEASE);
+        wake_workers(wp);
 
-        pthread_mutex_lock(&wp->mutex);
-        pthread_cond_broadcast(&wp->startcond);
-        pthread_mutex_unlock(&wp->mutex);
-
-        for (int i = 0; i < wp->nthreads; i++)
+        for (int i = 1; i < wp->nthreads; i++)
             pthread_join(wp->threads[i], NULL);
 
         pthread_mutex_destroy(&wp->mutex);
         pthread_cond_destroy(&wp->startcond);
-        pthread_cond_destroy(&wp->endcond);
         free(wp->threads);
     }
 
+    free(wp->deques);
+    free(wp->order);
+    free(wp->rank);
     zarray_destroy(wp->tasks);
     free(wp);
 }
@@ -156,45 +316,180 @@ int workerpool_get_nthreads(workerpool_t *wp)
     return wp->nthreads;
 }
 
+int workerpool_pin_threads(workerpool_t *wp, int first_cpu)
+{
+#ifdef __linux__
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        return -1;
+
+    int ret = 0;
+
+    for (int i = 1; i < wp->nthreads; i++) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET((first_cpu + i) % ncpus, &set);
+
+        if (pthread_setaffinity_np(wp->threads[i], sizeof(set), &set) != 0)
+            ret = -1;
+    }
+
+    return ret;
+#else
+    return -1;
+#endif
+}
+
+void workerpool_get_busy_utime(workerpool_t *wp, int64_t *busy_utime)
+{
+    for (int i = 0; i < wp->nthreads; i++)
+        busy_utime[i] = wp->deques[i].busy_utime;
+}
+
+void workerpool_reset_busy_utime(workerpool_t *wp)
+{
+    for (int i = 0; i < wp->nthreads; i++)
+        wp->deques[i].busy_utime = 0;
+}
+
 void workerpool_add_task(workerpool_t *wp, void (*f)(void *p), void *p)
+{
+    workerpool_add_task_cost(wp, f, p, 0);
+}
+
+void workerpool_add_task_cost(workerpool_t *wp, void (*f)(void *p), void *p, double cost)
 {
     struct task t;
     t.f = f;
     t.p = p;
+    t.cost = cost;
+
+    if (cost != 0)
+        wp->has_costs = 1;
 
     zarray_add(wp->tasks, &t);
 }
 
+int workerpool_partition(const double *costs, int n, int maxchunks, int *bounds)
+{
+    double total = 0;
+    for (int i = 0; i < n; i++)
+        total += costs[i];
+
+    double target = total / (maxchunks > 0 ? maxchunks : 1);
+
+    int nchunks = 0;
+    double acc = 0;
+
+    bounds[0] = 0;
+    for (int i = 0; i < n; i++) {
+        // an item that fills a chunk by itself doesn't join the
+        // cheaper ones before it.
+        if (costs[i] >= target && acc > 0) {
+            bounds[++nchunks] = i;
+            acc = 0;
+        }
+
+        acc += costs[i];
+
+        if (acc >= target || i == n - 1) {
+            bounds[++nchunks] = i + 1;
+            acc = 0;
+        }
+    }
+
+    return nchunks;
+}
+
+struct ranked_task
+{
+    double cost;
+    int idx;
+};
+
+static int ranked_task_compare(const void *_a, const void *_b)
+{
+    const struct ranked_task *a = _a, *b = _b;
+
+    if (a->cost != b->cost)
+        return a->cost < b->cost ? 1 : -1;
+
+    return a->idx - b->idx;
+}
+
 void workerpool_run_single(workerpool_t *wp)
 {
+    int64_t t0 = utime_now();
+
     for (int i = 0; i < zarray_size(wp->tasks); i++) {
         struct task *task;
         zarray_get_volatile(wp->tasks, i, &task);
         task->f(task->p);
     }
 
+    wp->deques[0].busy_utime += utime_now() - t0;
+    wp->has_costs = 0;
+
     zarray_clear(wp->tasks);
 }
 
 // runs all added tasks, waits for them to complete.
 void workerpool_run(workerpool_t *wp)
 {
-    if (wp->nthreads > 1) {
-        wp->end_count = 0;
+    int ntasks = zarray_size(wp->tasks);
 
-        pthread_mutex_lock(&wp->mutex);
-        pthread_cond_broadcast(&wp->startcond);
+    if (wp->nthreads > 1 && ntasks > 1) {
+        if (wp->order_alloc < ntasks) {
+            wp->order_alloc = ntasks;
+            wp->order = realloc(wp->order, ntasks * sizeof(int));
+            wp->rank = realloc(wp->rank, ntasks * sizeof(struct ranked_task));
+        }
 
-        while (wp->end_count < wp->nthreads) {
-//            printf("caught %d\n", wp->end_count);
-            pthread_cond_wait(&wp->endcond, &wp->mutex);
+        // start with the most expensive tasks.
+        struct ranked_task *rank = wp->rank;
+        for (int i = 0; i < ntasks; i++) {
+            struct task *task;
+            zarray_get_volatile(wp->tasks, i, &task);
+            rank[i].cost = task->cost;
+            rank[i].idx = i;
         }
 
-        pthread_mutex_unlock(&wp->mutex);
+        if (wp->has_costs)
+            qsort(rank, ntasks, sizeof(struct ranked_task), ranked_task_compare);
+
+        // deal the tasks out round-robin: participant i gets the
+        // tasks ranked i, i + nthreads, ... as the range [lo, hi) of
+        // order[].
+        int pos = 0;
+        for (int i = 0; i < wp->nthreads; i++) {
+            uint32_t lo = pos;
+            for (int j = i; j < ntasks; j += wp->nthreads)
+                wp->order[pos++] = rank[j].idx;
 
-        wp->taskspos = 0;
+            __atomic_store_n(&wp->deques[i].range, range_pack(lo, pos), __ATOMIC_RELEASE);
+        }
+
+        // the run is open to workers from here on.
+        __atomic_store_n(&wp->remaining, ntasks, __ATOMIC_SEQ_CST);
+
+        wake_workers(wp);
+
+        participate(wp, 0);
+
+        // wait for tasks that other threads are still running, and
+        // for every worker to be out of participate, so that none
+        // reaches into the next run's deques.
+        int spins = 0;
+        while (__atomic_load_n(&wp->remaining, __ATOMIC_SEQ_CST) > 0 ||
+               __atomic_load_n(&wp->active, __ATOMIC_SEQ_CST) > 0) {
+            if (++spins < WORKERPOOL_SPIN_ITERS)
+                cpu_relax();
+            else
+                sched_yield();
+        }
 
         zarray_clear(wp->tasks);
+        wp->has_costs = 0;
 
     } else {
         workerpool_run_single(wp);
@@ -103,6 +103,13 @@ void zarray_clear(zarray_t *za)
     za->size = 0;
 }
 
+void zarray_truncate(zarray_t *za, int sz)
+{
+    assert(za != NULL);
+    assert(sz >= 0 && sz <= za->size);
+    za->size = sz;
+}
+
 inline int zarray_size(const zarray_t *za)
 {
     assert(za != NULL);
@@ -125,13 +132,19 @@ inline void zarray_ensure_capacity(zarray_t *za, int capacity)
 
     if (za->alloc <= capacity) {
 
-        capacity = za->alloc * 2;
+        int newalloc = za->alloc;
 
-        if (capacity < MIN_ALLOC)
-            capacity = MIN_ALLOC;
+        // keep doubling, so that adding many elements at once stays
+        // amortized constant time too.
+        while (newalloc <= capacity) {
+            newalloc *= 2;
 
-        za->data = realloc(za->data, za->el_sz * capacity);
-        za->alloc = capacity;
+            if (newalloc < MIN_ALLOC)
+                newalloc = MIN_ALLOC;
+        }
+
+        za->data = realloc(za->data, za->el_sz * newalloc);
+        za->alloc = newalloc;
     }
 }
 
@@ -320,14 +333,11 @@ void zarray_add_all(zarray_t * dest, const zarray_t * source)
 {
     assert(dest->el_sz == source->el_sz);
 
-    // Don't allocate on stack because el_sz could be larger than ~8 MB
-    // stack size
-    char * tmp = calloc(1, dest->el_sz);
+    if (source->size == 0)
+        return;
 
-    for (int i = 0; i < zarray_size(source); i++) {
-        zarray_get(source, i, tmp);
-        zarray_add(dest, tmp);
-   }
+    zarray_ensure_capacity(dest, dest->size + source->size);
 
-    free(tmp);
+    memcpy(&dest->data[dest->size*dest->el_sz], source->data, source->size*source->el_sz);
+    dest->size += source->size;
 }
@@ -199,6 +199,12 @@ void zarray_vmap(zarray_t *za, void (*f)());
  */
 void zarray_clear(zarray_t *za);
 
+/**
+ * Removes all elements at index 'sz' and beyond, leaving 'sz' elements
+ * (which must be no more than there are).
+ */
+void zarray_truncate(zarray_t *za, int sz);
+
 /**
  * Determines whether any element in the array has a value which matches the
  * data pointed to by 'p'.
@@ -259,7 +259,7 @@ zarray_t *g2d_convex_hull(const zarray_t *points)
 void g2d_polygon_closest_boundary_point(const zarray_t *poly, const double q[2], double *p)
 {
     int psz = zarray_size(poly);
-    double min_dist = HUGE;
+    double min_dist = HUGE_VAL;
 
     for (int i = 0; i < psz; i++) {
         double *p0, *p1;
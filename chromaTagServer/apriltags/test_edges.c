@@ -0,0 +1,193 @@
+/* (C) 2013-2014, The Regents of The University of Michigan
+All rights reserved.
+
+This software may be available under alternative licensing
+terms. Contact Edwin Olson, ebolson@umich.edu, for more information.
+
+   Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FreeBSD Project.
+ */
+
+// Checks that skipping flat tiles (qtp.skip_flat_tiles) finds exactly
+// the edge pixels a pass over every pixel does, for both threshold
+// methods, on synthetic images whose features straddle tile
+// boundaries. Run from the Makefile's test target.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "apriltag.h"
+#include "image_u8.h"
+#include "zarray.h"
+#include "tag36h11.h"
+
+static void fill_rect(image_u8_t *im, int x0, int y0, int x1, int y1, uint8_t v)
+{
+    for (int y = y0; y < y1; y++)
+        for (int x = x0; x < x1; x++)
+            im->buf[y*im->stride + x] = v;
+}
+
+// a flat image with one dark square, not aligned to the tiles.
+static image_u8_t *make_square(void)
+{
+    image_u8_t *im = image_u8_create(320, 240);
+    fill_rect(im, 0, 0, 320, 240, 128);
+    fill_rect(im, 53, 77, 101, 131, 40);
+    return im;
+}
+
+// squares of both polarities, nested squares like a tag's border,
+// and some touching the image border; odd size, so the last tiles
+// are partial.
+static image_u8_t *make_mixed(void)
+{
+    image_u8_t *im = image_u8_create(333, 250);
+    fill_rect(im, 0, 0, 333, 250, 150);
+    fill_rect(im, 15, 31, 64, 80, 30);
+    fill_rect(im, 23, 39, 56, 72, 220);
+    fill_rect(im, 31, 47, 48, 64, 30);
+    fill_rect(im, 130, 15, 177, 33, 240);
+    fill_rect(im, 200, 100, 333, 117, 60);
+    fill_rect(im, 0, 200, 48, 250, 20);
+    fill_rect(im, 250, 160, 290, 240, 250);
+    fill_rect(im, 96, 144, 112, 160, 0);
+    return im;
+}
+
+// a horizontal ramp with noise too small to be an edge, and a few
+// squares.
+static image_u8_t *make_noisy(void)
+{
+    image_u8_t *im = image_u8_create(320, 240);
+    uint32_t seed = 1;
+    for (int y = 0; y < 240; y++) {
+        for (int x = 0; x < 320; x++) {
+            seed = seed * 1103515245 + 12345;
+            im->buf[y*im->stride + x] = 80 + x / 4 + (int) ((seed >> 16) % 5) - 2;
+        }
+    }
+    fill_rect(im, 40, 40, 90, 90, 10);
+    fill_rect(im, 180, 47, 230, 97, 250);
+    fill_rect(im, 111, 170, 150, 209, 20);
+    return im;
+}
+
+// the edge image the quad detector computes for im.
+static image_u8_t *edges(apriltag_detector_t *td, image_u8_t *im)
+{
+    zarray_t *detections = apriltag_detector_detect(td, im);
+    for (int i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_t *det;
+        zarray_get(detections, i, &det);
+        apriltag_detection_destroy(det);
+    }
+    zarray_destroy(detections);
+
+    return image_u8_create_from_pnm("debug_edge.pnm");
+}
+
+int main(int argc, char *argv[])
+{
+    // debug output goes to the current directory.
+    char dir[] = "/tmp/apriltag_test_XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        perror(dir);
+        return 1;
+    }
+
+    struct {
+        const char *name;
+        image_u8_t *(*make)(void);
+    } images[] = {
+        { "square", make_square },
+        { "mixed", make_mixed },
+        { "noisy", make_noisy },
+    };
+
+    apriltag_family_t *tf = tag36h11_create();
+    apriltag_detector_t *td = apriltag_detector_create();
+    apriltag_detector_add_family(td, tf);
+    td->nthreads = 1;
+    td->quad_decimate = 1;
+    td->quad_sigma = 0;
+    td->debug = 1;
+
+    int failures = 0;
+
+    for (int i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
+        image_u8_t *im = images[i].make();
+
+        for (int method = 0; method < 2; method++) {
+            for (int deglitch = 0; deglitch < 2; deglitch++) {
+                td->qtp.thresh_method = method ? APRILTAG_THRESH_MEAN : APRILTAG_THRESH_TILE;
+                td->qtp.deglitch = deglitch;
+
+                td->qtp.skip_flat_tiles = 0;
+                image_u8_t *full = edges(td, im);
+                td->qtp.skip_flat_tiles = 1;
+                image_u8_t *skip = edges(td, im);
+
+                int nedges = 0, ndiff = 0;
+                for (int y = 0; y < im->height; y++) {
+                    for (int x = 0; x < im->width; x++) {
+                        uint8_t a = full->buf[y*full->stride + x];
+                        uint8_t b = skip->buf[y*skip->stride + x];
+                        nedges += a != 0;
+                        ndiff += a != b;
+                    }
+                }
+
+                // an image without edges wouldn't test anything.
+                int ok = ndiff == 0 && nedges > 0;
+                failures += !ok;
+
+                printf("%-4s %-6s %-5s deglitch %d: %5d edge pixels, %5d differ\n",
+                       ok ? "ok" : "FAIL", images[i].name, method ? "mean" : "tile", deglitch,
+                       nedges, ndiff);
+
+                image_u8_destroy(full);
+                image_u8_destroy(skip);
+            }
+        }
+
+        image_u8_destroy(im);
+    }
+
+    apriltag_detector_destroy(td);
+    tag36h11_destroy(tf);
+
+    // leave the debug images if something went wrong.
+    if (failures == 0) {
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+        if (system(cmd) != 0)
+            fprintf(stderr, "couldn't remove %s\n", dir);
+    }
+
+    return failures ? 1 : 0;
+}
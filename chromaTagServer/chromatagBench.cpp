@@ -0,0 +1,269 @@
+// Standard C Libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <vector>
+
+// Server Libraries
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "apriltags/common/getopt.h"
+#include "apriltags/common/time_util.h"
+
+#include "lib/broadcast.hpp"
+#include "lib/detection_protocol.hpp"
+#include "lib/shm_ring.hpp"
+
+/**
+ * Latency from publishing a frame to a co-located consumer having
+ * it, through the shared memory ring and through the TCP broadcaster
+ * (binary messages, loopback). No camera: synthetic frames are
+ * published at a fixed rate, each path read by its own process.
+ * Each reader also checks every frame it got is the one that was
+ * written (a torn seqlock read would show here).
+ */
+
+// Detections are a function of the frame, so readers can check them.
+static void fill_frame(ctag_frame *f, uint32_t seq, int ndets){
+  f->seq = seq;
+  f->width = 1280;
+  f->height = 720;
+  f->detections.resize(ndets);
+  for (int i = 0; i < ndets; i++) {
+    ctag_detection *d = &f->detections[i];
+    memset(d, 0, sizeof(*d));
+    d->family_bits = 36;
+    d->family_h = 11;
+    d->id = (seq + i) % 587;
+    d->flags = CTAG_POSE_VALID;
+    for (int j = 0; j < 9; j++)
+      d->R[j] = seq + j;
+    d->T[2] = seq;
+  }
+}
+
+static bool check_frame(uint32_t seq, int ndets, const ctag_detection *dets){
+  for (int i = 0; i < ndets; i++) {
+    if (dets[i].id != (seq + i) % 587 || dets[i].T[2] != (float) seq || dets[i].R[8] != (float) (seq + 8))
+      return false;
+  }
+  return true;
+}
+
+struct latency_stats {
+  std::vector<int64_t> us;
+  uint64_t bad;
+
+  latency_stats() : bad(0) {}
+
+  void print(const char *name, uint32_t nframes, uint64_t lost){
+    std::sort(us.begin(), us.end());
+    size_t n = us.size();
+    if (n == 0) {
+      printf("%-5s received nothing\n", name);
+      return;
+    }
+    printf("%-5s %6d/%d frames, %" PRIu64 " lost, %" PRIu64 " bad; latency us: median %" PRId64
+           ", p90 %" PRId64 ", p99 %" PRId64 ", max %" PRId64 "\n",
+           name, (int) n, nframes, lost, bad, us[n/2], us[n*9/10], us[n*99/100], us[n-1]);
+  }
+};
+
+static int run_shm_reader(const char *name, int nframes, bool poll){
+  shm_ring_reader reader;
+  if (!reader.open(name))
+    return 1;
+
+  printf("ready\n");
+  fflush(stdout);
+
+  latency_stats st;
+  shm_ring_frame *f = new shm_ring_frame;
+  while (1) {
+    int res = poll ? reader.next(f) : reader.wait(f, -1);
+    if (res < 0)
+      break;
+    if (res == 0)
+      continue;
+
+    st.us.push_back(utime_now() - f->capture_utime);
+    if (!check_frame(f->seq, f->ndetections, f->detections))
+      st.bad++;
+  }
+
+  st.print(poll ? "shm-p" : "shm", nframes, reader.lost());
+  delete f;
+  return 0;
+}
+
+static int run_tcp_reader(int port, int nframes){
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+    printf("tcp: %s\n", strerror(errno));
+    return 1;
+  }
+
+  latency_stats st;
+  ctag_stream stream;
+  ctag_frame f;
+  uint32_t next_seq = 0;
+  uint64_t lost = 0;
+
+  char buf[65536];
+  while (1) {
+    ssize_t r = recv(fd, buf, sizeof(buf), 0);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+
+    int64_t now = utime_now();
+    stream.feed(buf, r);
+    while (stream.next(&f) > 0) {
+      st.us.push_back(now - f.capture_utime);
+      lost += f.seq - next_seq;
+      next_seq = f.seq + 1;
+      if (!f.detections.empty() && !check_frame(f.seq, f.detections.size(), &f.detections[0]))
+        st.bad++;
+    }
+  }
+
+  st.print("tcp", nframes, lost);
+  close(fd);
+  return 0;
+}
+
+int main(int argc, char * argv[]){
+
+  getopt_t *getopt = getopt_create();
+
+  getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+  getopt_add_int(getopt, 'n', "frames", "5000", "Publish this many frames");
+  getopt_add_int(getopt, 'r', "rate", "500", "Frames per second");
+  getopt_add_int(getopt, 'd', "detections", "4", "Tags in each frame");
+  getopt_add_int(getopt, 'S', "slots", "64", "Frames the shared memory ring holds");
+  getopt_add_bool(getopt, 'P', "poll", 0, "Shared memory reader spins instead of sleeping on the futex");
+
+  if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+    printf("Usage: %s [options]\n", argv[0]);
+    getopt_do_usage(getopt);
+    exit(0);
+  }
+
+  int nframes = getopt_get_int(getopt, "frames");
+  int rate = getopt_get_int(getopt, "rate");
+  int ndets = getopt_get_int(getopt, "detections");
+  bool poll = getopt_get_bool(getopt, "poll");
+  if (ndets > SHM_RING_MAX_DETECTIONS)
+    ndets = SHM_RING_MAX_DETECTIONS;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  char name[64];
+  snprintf(name, sizeof(name), "/chromatag-bench-%d", (int) getpid());
+  shm_ring_publisher ring;
+  if (!ring.create(name, getopt_get_int(getopt, "slots")))
+    return 1;
+
+  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrlen = sizeof(addr);
+  if (bind(server_fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(server_fd, SOMAXCONN) ||
+      getsockname(server_fd, (struct sockaddr*) &addr, &addrlen)) {
+    printf("%s\n", strerror(errno));
+    return 1;
+  }
+
+  broadcaster bc(server_fd, 1024);
+  if (!bc.start())
+    return 1;
+
+  // the shm reader says when it has attached; it only sees frames
+  // published after that.
+  int ready[2];
+  if (pipe(ready) != 0)
+    return 1;
+
+  fflush(stdout);
+  pid_t shm_pid = fork();
+  if (shm_pid == 0) {
+    dup2(ready[1], 1);
+    int res = run_shm_reader(name, nframes, poll);
+    fflush(stdout);
+    _exit(res);
+  }
+  close(ready[1]);
+  FILE *shm_out = fdopen(ready[0], "r");
+  char line[256];
+  if (fgets(line, sizeof(line), shm_out) == NULL || strcmp(line, "ready\n") != 0)
+    return 1;
+
+  pid_t tcp_pid = fork();
+  if (tcp_pid == 0) {
+    int res = run_tcp_reader(ntohs(addr.sin_port), nframes);
+    fflush(stdout);
+    _exit(res);
+  }
+
+  while (bc.nclients() < 1)
+    usleep(1000);
+
+  printf("%d frames of %d tags at %d/s\n", nframes, ndets, rate);
+  fflush(stdout);
+
+  ctag_frame f;
+  std::string bytes;
+  int64_t period = 1000000 / (rate > 0 ? rate : 1);
+  int64_t next = utime_now();
+
+  for (int i = 0; i < nframes; i++) {
+    fill_frame(&f, i, ndets);
+
+    // alternate which path goes first, so neither always waits for
+    // the other.
+    f.capture_utime = utime_now();
+    if (i & 1)
+      ring.publish(&f);
+    bytes.clear();
+    ctag_encode(&f, &bytes);
+    bc.publish(bytes.data(), bytes.size());
+    if (!(i & 1))
+      ring.publish(&f);
+
+    next += period;
+    int64_t wait = next - utime_now();
+    if (wait > 0)
+      usleep(wait);
+  }
+
+  usleep(200000);                                           // let the TCP reader drain
+  ring.close();
+  bc.stop();
+
+  waitpid(tcp_pid, NULL, 0);
+  while (fgets(line, sizeof(line), shm_out) != NULL)
+    fputs(line, stdout);
+  waitpid(shm_pid, NULL, 0);
+
+  close(server_fd);
+  getopt_destroy(getopt);
+
+  return 0;
+}
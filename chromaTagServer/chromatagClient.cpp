@@ -0,0 +1,162 @@
+// Standard C Libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+// Client Libraries
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "apriltags/common/getopt.h"
+#include "apriltags/common/time_util.h"
+
+#include "lib/detection_protocol.hpp" // decodes the server's messages
+#include "lib/shm_ring.hpp" // or reads them from shared memory, on the server's host
+
+/**
+ * Example client for chromatagServer: connects, decodes each frame
+ * message and prints its detections, the frames missed (sequence
+ * gaps) and how long ago the frame was captured. The latency is
+ * only meaningful when both clocks are synchronized.
+ *
+ * With -S, reads the server's shared memory ring (chromatagServer -S)
+ * instead of connecting.
+ */
+
+static bool first = true;
+static uint32_t next_seq = 0;
+static uint64_t missed = 0;
+
+static void print_frame(uint32_t seq, uint64_t capture_utime, int width, int height,
+                        int ndetections, const ctag_detection *detections, int quiet){
+
+  if (!first && seq != next_seq)
+    missed += seq - next_seq;
+  first = false;
+  next_seq = seq + 1;
+
+  printf("frame %" PRIu32 ": %dx%d, %d tags, %.3fms old, %" PRIu64 " missed\n",
+         seq, width, height, ndetections,
+         (utime_now() - (int64_t) capture_utime) / 1.0E3, missed);
+
+  if (quiet)
+    return;
+
+  for (int i = 0; i < ndetections; i++) {
+    const ctag_detection *d = &detections[i];
+    printf("  tag%dh%d id %4d, hamming %d, margin %6.2f, center (%7.2f,%7.2f)",
+           d->family_bits, d->family_h, d->id, d->hamming, d->margin, d->c[0], d->c[1]);
+    if (d->flags & CTAG_POSE_VALID)
+      printf(", T [%g %g %g]", d->T[0], d->T[1], d->T[2]);
+    printf("\n");
+  }
+}
+
+static int read_shm(const char *name, int quiet){
+
+  shm_ring_reader reader;
+  if (!reader.open(name))
+    return 1;
+
+  shm_ring_frame *f = new shm_ring_frame;
+  while (reader.wait(f, -1) > 0)
+    print_frame(f->seq, f->capture_utime, f->width, f->height, f->ndetections, f->detections, quiet);
+
+  printf("server stopped; %" PRIu64 " frames lost falling behind\n", reader.lost());
+  delete f;
+  return 0;
+}
+
+static int connect_to(const char *host, const char *port){
+
+  struct addrinfo hints;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res = 0;
+
+  int err = getaddrinfo(host,port,&hints,&res);
+  if (err != 0) {
+    printf("failed to resolve %s:%s (%s)\n",host,port,gai_strerror(err));
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+    fd = socket(ai->ai_family,ai->ai_socktype,ai->ai_protocol);
+    if (fd == -1)
+      continue;
+    if (connect(fd,ai->ai_addr,ai->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd == -1)
+    printf("failed to connect to %s:%s (%s)\n",host,port,strerror(errno));
+  return fd;
+}
+
+int main(int argc, char * argv[]){
+
+  getopt_t *getopt = getopt_create();
+
+  getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+  getopt_add_string(getopt, 'a', "host", "localhost", "Server to connect to");
+  getopt_add_string(getopt, 'p', "port", "9499", "Server port");
+  getopt_add_bool(getopt, 'q', "quiet", 0, "Print only a summary per frame");
+  getopt_add_string(getopt, 'S', "shm", "", "Read this shared memory ring instead of connecting");
+
+  if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+    printf("Usage: %s [options]\n", argv[0]);
+    getopt_do_usage(getopt);
+    exit(0);
+  }
+
+  int quiet = getopt_get_bool(getopt, "quiet");
+
+  const char *shm_name = getopt_get_string(getopt, "shm");
+  if (shm_name[0] != 0) {
+    int res = read_shm(shm_name, quiet);
+    getopt_destroy(getopt);
+    return res;
+  }
+
+  int fd = connect_to(getopt_get_string(getopt, "host"), getopt_get_string(getopt, "port"));
+  if (fd == -1)
+    return 1;
+
+  ctag_stream stream;
+  ctag_frame f;
+
+  char buf[65536];
+  while (1) {
+    ssize_t r = recv(fd, buf, sizeof(buf), 0);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+
+    stream.feed(buf, r);
+
+    int res;
+    while ((res = stream.next(&f)) > 0)
+      print_frame(f.seq, f.capture_utime, f.width, f.height, f.detections.size(),
+                  f.detections.empty() ? NULL : &f.detections[0], quiet);
+
+    if (res < 0) {
+      printf("not a chromatag stream (version %d expected)\n", CTAG_PROTOCOL_VERSION);
+      break;
+    }
+  }
+
+  close(fd);
+  getopt_destroy(getopt);
+
+  return 0;
+}
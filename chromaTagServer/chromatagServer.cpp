@@ -12,11 +12,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
 // Apriltags libraries
 #include "apriltags/apriltag.h"
+#include "apriltags/apriltag_tracker.h"
+#include "apriltags/apriltag_resolution.h"
 #include "apriltags/common/image_u8.h"
 #include "apriltags/tag36h11.h"
 #include "apriltags/tag36h10.h"
@@ -26,13 +29,23 @@
 
 #include "apriltags/common/zarray.h"
 #include "apriltags/common/getopt.h"
+#include "apriltags/common/time_util.h"
 
 // Our extensions for chromatags
 #include "lib/rgb2lab.hpp" // functions to convert to rgb to lab, and seperate color channels
 #include "lib/pnm2mat.hpp" // functions to convert pnm to and from mat
+#include "lib/broadcast.hpp" // sends each result to every connected client
+#include "lib/detection_protocol.hpp" // binary message sent for each frame
+#include "lib/shm_ring.hpp" // the same, through shared memory for local consumers
 
 #define MY_PORT		"9499"
 
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_sigint(int sig){
+  stop_requested = 1;
+}
+
 /*
  * Generates the object points based on the size of the chromatag
  */
@@ -96,34 +109,44 @@ Mat getCameraDist(){
 }
 
 /**
- * handle_session(int session_fd):
- *     Runs when a user connects to the server
- *     Connection port (MY_PORT): 9499
+ * capture_loop(broadcaster *bc, shm_ring_publisher *ring, getopt_t *getopt):
+ *     The one camera and detector shared by every client.
+ *     Runs until interrupted (or a key is pressed in the window).
  *     
- *     Sends the client an RT matrix, in the form:
+ *     Publishes a ctag_frame message (lib/detection_protocol.hpp)
+ *     for each frame: every tag with its id, corners and pose. With
+ *     --text, publishes only the last tag's RT matrix, as before:
  *
  *     [R00,R10,R20,T0,R01,R11,R21,T1,R02,R12,R22,T2]\n
  *
  *     The chromaTag size is assumed by be 3cm, 
  *     the function generateObjectTag(size) is set to 3cm.
+ *
+ *     Every frame's detections also go to ring, if given, for
+ *     consumers on this host.
+ *
+ *     Headless, nothing is drawn or shown, and frames are only
+ *     detected while a client is connected (always, with a ring:
+ *     its readers can't be counted).
  */
-void handle_session(int session_fd){
+void capture_loop(broadcaster *bc, shm_ring_publisher *ring, getopt_t *getopt){
 
   int MAXBUF = 2048;
 
   bool showGradientEdges = false;
+  bool headless = getopt_get_bool(getopt, "headless");
+  bool idle = false;                                        // headless with nobody to send to
+  bool text = getopt_get_bool(getopt, "text");
   bool found = false;
   bool init = true;
   vector<Point2f> initPts;
   
   VideoCapture cap(0);                                      // open the default camera
   
-  int w = 768;
-  int h = 432;
-
-  Size size(w,h);                                           // size of desired frame: 1280x720, 768x432
-  if(!cap.isOpened())                                       // check if camera opened
+  if(!cap.isOpened()){                                      // check if camera opened
+    printf("Couldn't open the camera\n");
     return;
+  }
 
   Mat a, b, g, frame, src;
 
@@ -141,10 +164,17 @@ void handle_session(int session_fd){
 
   td->quad_decimate = 1.0;                                  // Decimate input image by factor
   td->quad_sigma = 0.0;                                     // No blur (I think)
-  td->nthreads = 4;                                         // 4 treads provided
+  td->nthreads = getopt_get_int(getopt, "threads");         // Threads for detection
   td->debug = 0;                                            // No debuging output
   td->refine_decode = 0;                                    // Don't refine decode
   td->refine_pose = 0;                                      // Don't refine pose
+  td->decode_budget_us = 10000;                             // Bound decoding in clutter, best quads first
+
+  apriltag_tracker_t *tt = apriltag_tracker_create(td);     // Search near where tags were last seen
+  tt->track_edges = 1;                                      // Follow known tags by their edges
+
+  apriltag_resolution_t *rc = apriltag_resolution_create(33); // Keep up with a 30fps camera
+  double scale = 1.0;                                       // Frames are resized by this before detection
 
   // Output variables
   char imgSize[20];
@@ -160,6 +190,11 @@ void handle_session(int session_fd){
   double count = 0.0;
 
   char buffer[MAXBUF]; // buffer to transfer over server
+  int chars_written = 0;
+
+  ctag_frame msg;                                           // binary message, reused
+  std::string msgBytes;
+  uint32_t seq = 0;
 
   /* End of apriltag_demo.c */
 
@@ -169,13 +204,9 @@ void handle_session(int session_fd){
   Mat rvec, tvec;
   double centerPoint[2];
 
-  int opt1 = 0;
-  int opt2 = 0;					
-  int searchWidth = 0;
-  int searchHeight = 0;
   vector<Point2f> pts;
 
-  while(1){
+  while(!stop_requested){
 
     memset(buffer, 0, sizeof(buffer));
 
@@ -183,37 +214,30 @@ void handle_session(int session_fd){
     t = clock();
     
     cap >> src;                                               // Get a new frame from camera
+    if(src.empty())
+      break;
+
+    msg.seq = seq++;                                          // Counts skipped frames too
+    msg.capture_utime = utime_now();
+
+    if(headless && ring == NULL && bc->nclients() == 0){                      // Keep the camera running, skip the work
+      idle = true;
+      continue;
+    }
+    if(idle){                                                 // Tracks are stale after idling
+      apriltag_tracker_reset(tt);
+      idle = false;
+    }
     
-    if(found){
-      w = 3*src.size().width/5;                              // Reset width based on frame
-      h = 3*src.size().height/5;                             // Reset height based on frame
-      size = Size(w,h);                                      // Sets size based on width and height
-      resize(src,frame,size);                                // Resize to smaller image if tag found
-
-      opt1 = centerPoint[0];                                 // Rectangle to search on prediction
-      opt2 = centerPoint[1];                                 // Rectangle to search on prediction
-      searchWidth = w/2;                                     // Search predicted location, width
-      searchHeight = h/2;                                      // Search predicted location, height
-      opt1 = opt1 - searchWidth/2;                           // Rectangle to search on prediction
-      opt2 = opt2 - searchHeight/2;                          // Rectangle to search on prediction
-      
-      std::cout << opt1 << ", " << opt2 << std::endl;
-      
-      // Ensures search rectangle is within the search frame
-      if((opt1 + searchWidth < frame.size().width && opt1 > 0)
-      && (opt2 + searchHeight < frame.size().height && opt2 > 0)){
-        Mat newFrame = frame;
-        frame = newFrame(Rect(opt1,opt2,searchWidth,searchHeight));
-      }else{
-        std::cout << "\n\nNO SEARCH FRAME" << std::endl;
-        opt1 = opt2 = 0;
-        searchWidth = searchHeight = 1;
-      }
-    }else{
-      frame = src;                                            // Keep standard image if no tag
-      opt1 = opt2 = 0;
-      searchWidth = searchHeight = 1;
+    if(rc->scale != scale){                                   // Resolution changed; move the tracks to match
+      apriltag_tracker_rescale(tt, rc->scale / scale);
+      scale = rc->scale;
     }
+
+    if(scale < 1.0)
+      resize(src, frame, Size(), scale, scale, INTER_AREA);   // Detect at the chosen resolution
+    else
+      frame = src;
     
     //frame = RGB2YUV(frame);                                 // Just for comparison
     frame = RGB2LAB(frame);                                   // Returns lab space
@@ -223,7 +247,7 @@ void handle_session(int session_fd){
     std::cout << "Center: (" << centerPoint[0] << ", " << centerPoint[1] << ") ";
     std::cout << " Size: " << frame.size().width <<"x" << frame.size().height << std::endl;
 
-    if(showGradientEdges){
+    if(showGradientEdges && !headless){
       src = gradientEdges(src);                               // Show graprintfnt for fun
     }
     
@@ -235,16 +259,20 @@ void handle_session(int session_fd){
     image_u8_t *im = pnm_to_image_u8(pnm);                    // Convert pnm to gray image_u8
     if (im == NULL) {                                         // Error - no image created from pnm
       std::cout << "Error, not a proper pnm" << std::endl;
-      return;
+      break;
     }
 
     /*** Start from origional Apriltags from apriltag_demo.c ***/
 
     int hamm_hist[hamm_hist_max];
     memset(hamm_hist, 0, sizeof(hamm_hist));
-    zarray_t *detections = apriltag_detector_detect(td, im);
+    zarray_t *detections = apriltag_tracker_update(tt, im);
+    apriltag_resolution_update(rc, tt, scale, time_taken + timeprofile_total_utime(td->tp) / 1.0E3);
+
+    msg.width = src.cols;
+    msg.height = src.rows;
+    msg.detections.resize(zarray_size(detections));
 
-    int chars_written;
     for (int i = 0; i < zarray_size(detections); i++) {
 
       apriltag_detection_t *det;
@@ -256,26 +284,13 @@ void handle_session(int session_fd){
       hamm_hist[det->hamming]++;
 
       // draws a vertical rectangle around tag, not ideal, but easy to implement
-      // det->p[corner][positon], counter clockwise
+      // det->p[corner][positon], counter clockwise, in the resized frame
       pts.clear();
       for(int i = 0; i < 4; i++)
-        pts.push_back(Point(det->p[i][0], det->p[i][1]));
-
-      // If tag found flag, scale to image size for quick search
-      if(found){
-        Size s = src.size();
-        int cpx = 5*opt1/3;
-        int cpy = 5*opt2/3;
-        pts[0] = Point(((det->p[0][0] + cpx)/w) * s.width, ((det->p[0][1] + cpy)/h) * s.height);
-        pts[1] = Point(((det->p[1][0] + cpx)/w) * s.width, ((det->p[1][1] + cpy)/h) * s.height);
-        pts[2] = Point(((det->p[2][0] + cpx)/w) * s.width, ((det->p[2][1] + cpy)/h) * s.height);
-        pts[3] = Point(((det->p[3][0] + cpx)/w) * s.width, ((det->p[3][1] + cpy)/h) * s.height);
-        centerPoint[0] = ((det->c[0] + cpx)/w) * s.width;
-        centerPoint[1] = ((det->c[1] + cpy)/h) * s.height;
-      }else{
-        centerPoint[0] = det->c[0];
-        centerPoint[1] = det->c[1];
-      }
+        pts.push_back(Point(det->p[i][0] / scale, det->p[i][1] / scale));
+
+      centerPoint[0] = det->c[0] / scale;
+      centerPoint[1] = det->c[1] / scale;
 
       if(init){
         initPts.push_back(pts[0]);
@@ -296,42 +311,53 @@ void handle_session(int session_fd){
       bool foundNaN = false;
       for(int i = 0; i < 3; i++) {
         for(int j = 0; j < 3; j++) {
-          double d = rvec.at<double>(i, j);
+          double d = R.at<double>(i, j);
           if (d != d) {
             foundNaN = true;
-            rvec.at<double>(i, j) = 0.0;
+            R.at<double>(i, j) = 0.0;
           }
         }
+        if (tvec.at<double>(i) != tvec.at<double>(i)) {
+          foundNaN = true;
+          tvec.at<double>(i) = 0.0;
+        }
       }
 
-      // Write RT matrix to socket
-      sprintf(buffer, "[%g,%g,%g,%g",
-              rvec.at<double>(0,0),
-              rvec.at<double>(1,0),
-              rvec.at<double>(2,0),
-	      tvec.at<double>(0));
-
-      sprintf(buffer, "%s,%g,%g,%g,%g", buffer,
-              rvec.at<double>(0,1),
-              rvec.at<double>(1,1),
-              rvec.at<double>(2,1),
-              tvec.at<double>(1));
+      ctag_detection *d = &msg.detections[i];
+      d->family_bits = det->family->d * det->family->d;
+      d->family_h = det->family->h;
+      d->id = det->id;
+      d->hamming = det->hamming;
+      d->flags = foundNaN ? 0 : CTAG_POSE_VALID;
+      d->margin = det->decision_margin;
+      d->c[0] = centerPoint[0];
+      d->c[1] = centerPoint[1];
+      for(int j = 0; j < 4; j++) {
+        d->p[j][0] = det->p[j][0] / scale;
+        d->p[j][1] = det->p[j][1] / scale;
+      }
+      for(int j = 0; j < 9; j++)
+        d->R[j] = R.at<double>(j / 3, j % 3);
+      for(int j = 0; j < 3; j++)
+        d->T[j] = tvec.at<double>(j);
 
-      chars_written = sprintf(buffer, "%s,%g,%g,%g,%g]\n", buffer,
-              rvec.at<double>(0,2),
-              rvec.at<double>(1,2),
-              rvec.at<double>(2,2),
-              tvec.at<double>(2));
+      // RT matrix for --text clients
+      if(text)
+        chars_written = snprintf(buffer, MAXBUF, "[%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g]\n",
+                                 R.at<double>(0,0), R.at<double>(1,0), R.at<double>(2,0), tvec.at<double>(0),
+                                 R.at<double>(0,1), R.at<double>(1,1), R.at<double>(2,1), tvec.at<double>(1),
+                                 R.at<double>(0,2), R.at<double>(1,2), R.at<double>(2,2), tvec.at<double>(2));
 
-      cv::rectangle(src, pts[0], pts[2], cvScalar(102,255,0));
+      if(!headless)
+        cv::rectangle(src, pts[0], pts[2], cvScalar(102,255,0));
 
       std::cout << "Rotation and Translation Matrix: " << std::endl;
-      std::cout << "\t[ "<<rvec.at<double>(0,0)<<" "<<rvec.at<double>(1,0)<<" "<<rvec.at<double>(2,0)<<" ]";
-      std::cout << "\t[ "<<tvec.at<double>(0,0)<<" ]"<<std::endl;
-      std::cout << "\t[ "<< rvec.at<double>(0,1)<<" "<<rvec.at<double>(1,1)<<" "<<rvec.at<double>(2,1)<<" ]";
-      std::cout << "\t[ "<<tvec.at<double>(0,1)<<" ]"<<std::endl;
-      std::cout << "\t[ "<< rvec.at<double>(0,2)<<" "<<rvec.at<double>(1,2)<<" "<<rvec.at<double>(2,2)<<" ]";
-      std::cout << "\t[ "<<tvec.at<double>(0,2)<<" ]"<<std::endl;
+      std::cout << "\t[ "<<R.at<double>(0,0)<<" "<<R.at<double>(1,0)<<" "<<R.at<double>(2,0)<<" ]";
+      std::cout << "\t[ "<<tvec.at<double>(0)<<" ]"<<std::endl;
+      std::cout << "\t[ "<< R.at<double>(0,1)<<" "<<R.at<double>(1,1)<<" "<<R.at<double>(2,1)<<" ]";
+      std::cout << "\t[ "<<tvec.at<double>(1)<<" ]"<<std::endl;
+      std::cout << "\t[ "<< R.at<double>(0,2)<<" "<<R.at<double>(1,2)<<" "<<R.at<double>(2,2)<<" ]";
+      std::cout << "\t[ "<<tvec.at<double>(2)<<" ]"<<std::endl;
 
       apriltag_detection_destroy(det);
     }
@@ -344,9 +370,18 @@ void handle_session(int session_fd){
       sprintf(locationString, "No tag detected");
     }else{
       found = true;
-      write(session_fd, buffer, chars_written);
    }
 
+    if(!text){                                                // Every frame, so clients see gaps and liveness
+      msgBytes.clear();
+      ctag_encode(&msg, &msgBytes);
+      bc->publish(msgBytes.data(), msgBytes.size());          // Queued for every client
+    }else if(found){
+      bc->publish(buffer, chars_written);
+    }
+    if(ring != NULL)
+      ring->publish(&msg);                                    // No system call unless a reader sleeps
+
     zarray_destroy(detections);
     image_u8_destroy(im);
 
@@ -360,7 +395,7 @@ void handle_session(int session_fd){
         totalFPS = 0.0;
         count = 0.0;
       }
-      sprintf(displayString, "fps: %2.2Lf, nquads: %d",totalFPS/count, td->nquads);
+      sprintf(displayString, "fps: %2.2Lf, nquads: %d, scale: %.2f",totalFPS/count, td->nquads, scale);
     }
 
     sprintf(renderTime, "Render: %5.3fms", time_taken);
@@ -376,6 +411,9 @@ void handle_session(int session_fd){
 
     /*** End of origional Apriltags from apriltag_demo.c ***/
 
+    if(headless)
+      continue;
+
     // displays fps, edges, segments, quads
     putText(src, displayString, cvPoint(30,30),
             FONT_HERSHEY_COMPLEX_SMALL, 0.8, cvScalar(200,200,250), 1, CV_AA);
@@ -399,14 +437,38 @@ void handle_session(int session_fd){
   }
 
   /* deallocate apriltag constructs */
+  apriltag_resolution_destroy(rc);
+  apriltag_tracker_destroy(tt);
   apriltag_detector_destroy(td);
   tag36h11_destroy(tf);
 }
 
 int main(int argc, char * argv[]){
 
+  getopt_t *getopt = getopt_create();
+
+  getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+  getopt_add_string(getopt, 'p', "port", MY_PORT, "Listen for clients on this port");
+  getopt_add_bool(getopt, 'H', "headless", 0, "Don't open a window; only detect while a client is connected");
+  getopt_add_int(getopt, 't', "threads", "4", "Use this many CPU threads for detection");
+  getopt_add_int(getopt, 'Q', "queue", "64", "Drop a client's oldest results once this many are waiting to be sent");
+  getopt_add_bool(getopt, 'T', "text", 0, "Send the old text RT line (last tag only) instead of binary messages");
+  getopt_add_string(getopt, 'S', "shm", "", "Also publish detections to local readers through this shared memory name, e.g. /chromatag");
+  getopt_add_int(getopt, '\0', "shm-slots", "64", "Frames the shared memory ring holds");
+
+  if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+    printf("Usage: %s [options]\n", argv[0]);
+    getopt_do_usage(getopt);
+    exit(0);
+  }
+
+  if (getopt_get_int(getopt, "queue") < 1) {
+    printf("--queue must be at least 1\n");
+    return 1;
+  }
+
   const char* hostname = 0;
-  const char* portname = MY_PORT;
+  const char* portname = getopt_get_string(getopt, "port");
   struct addrinfo hints;
   memset(&hints,0,sizeof(hints));
   hints.ai_family = AF_UNSPEC;
@@ -418,66 +480,53 @@ int main(int argc, char * argv[]){
   int err = getaddrinfo(hostname,portname,&hints,&res);
 
   if (err != 0) {
-    printf("failed to resolve local socket address (err=%d)",err);
+    printf("failed to resolve local socket address (err=%d)\n",err);
+    return 1;
   }
 
   int server_fd=socket(res->ai_family,res->ai_socktype,res->ai_protocol);
   if (server_fd == -1) {
-    printf("%s",strerror(errno));
+    printf("%s\n",strerror(errno));
+    return 1;
   }
 
   int reuseaddr = 1;
   if (setsockopt(server_fd,SOL_SOCKET,SO_REUSEADDR,&reuseaddr,sizeof(reuseaddr))==-1) {
-    printf("%s",strerror(errno));
+    printf("%s\n",strerror(errno));
   }
 
   if (bind(server_fd,res->ai_addr,res->ai_addrlen) == -1) {
-    printf("%s",strerror(errno));
+    printf("%s\n",strerror(errno));
+    return 1;
   }
 
   if (listen(server_fd,SOMAXCONN)) {
-    printf("failed to listen for connections (errno=%d)",errno);
+    printf("failed to listen for connections (errno=%d)\n",errno);
+    return 1;
   }
 
-  for (;;) {
-    int session_fd = accept(server_fd,0,0);
-    if (session_fd == -1) {
-      if (errno == EINTR) continue;
-      printf("failed to accept connection (errno=%d)",errno);
-    }
-    pid_t pid = fork();
-    if (pid == -1) {
-      printf("failed to create child process (errno=%d)",errno);
-    } else if (pid == 0) {
-      close(server_fd);
-      handle_session(session_fd);
-      close(session_fd);
-      _exit(0);
-    } else {
-      close(session_fd);
-    }
-  }
+  freeaddrinfo(res);
 
-  for (;;) {
-    int session_fd = accept(server_fd,0,0);
-    if (session_fd == -1) {
-      if (errno == EINTR) continue;
-      printf("failed to accept connection (errno=%d)",errno);
-    }
-    pid_t pid = fork();
-    if (pid == -1) {
-      printf("failed to create child process (errno=%d)",errno);
-    } else if (pid == 0) {
-      close(server_fd);
-      handle_session(session_fd);
-      close(session_fd);
-      _exit(0);
-    } else {
-      close(session_fd);
-    }
-  }
+  // One camera and detector for everyone: clients only add sends.
+  broadcaster bc(server_fd, getopt_get_int(getopt, "queue"));
+  if (!bc.start())
+    return 1;
 
-  freeaddrinfo(res);
+  signal(SIGINT, handle_sigint);
+
+  shm_ring_publisher ring;
+  const char *shm_name = getopt_get_string(getopt, "shm");
+  if (shm_name[0] != 0 && !ring.create(shm_name, getopt_get_int(getopt, "shm-slots")))
+    return 1;
+
+  capture_loop(&bc, shm_name[0] != 0 ? &ring : NULL, getopt);
+
+  ring.close();
+  bc.stop();
+  printf("%llu results dropped for slow clients\n", (unsigned long long) bc.dropped());
+
+  close(server_fd);
+  getopt_destroy(getopt);
 
   return 0;
 }
@@ -0,0 +1,306 @@
+/**
+ * Fans messages out to every connected client.
+ *
+ * One thread runs an epoll loop over the listening socket, the
+ * clients, and an eventfd that publish() uses to wake it. All
+ * sockets are non-blocking. Each client has its own queue of
+ * messages still to be sent, so a slow client only delays itself;
+ * when its queue is full the oldest whole messages are dropped (the
+ * newest pose is the one that matters).
+ *
+ * Clients may send anything; it is read and ignored. Linux only.
+ */
+
+#ifndef _BROADCAST_HPP
+#define _BROADCAST_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+class broadcaster {
+public:
+  // listen_fd must be bound and listening; it is made non-blocking
+  // but stays owned by the caller. At most max_queued (at least 1)
+  // messages wait for any one client.
+  broadcaster(int listen_fd, size_t max_queued)
+    : listen_fd(listen_fd), max_queued(max_queued), epfd(-1), wake_fd(-1),
+      running(0), clients_connected(0), ndropped(0) {
+    pthread_mutex_init(&lock, NULL);
+  }
+
+  ~broadcaster() {
+    stop();
+    pthread_mutex_destroy(&lock);
+  }
+
+  // Returns false (having said why) if the event loop can't start.
+  bool start() {
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    epfd = epoll_create1(0);
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (epfd < 0 || wake_fd < 0) {
+      printf("broadcast: %s\n", strerror(errno));
+      return false;
+    }
+
+    watch(listen_fd, EPOLLIN);
+    watch(wake_fd, EPOLLIN);
+
+    running = 1;
+    if (pthread_create(&thread, NULL, thread_main, this)) {
+      running = 0;
+      printf("broadcast: can't create thread\n");
+      return false;
+    }
+    return true;
+  }
+
+  void stop() {
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+      return;
+
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    wake();
+    pthread_join(thread, NULL);
+
+    for (std::map<int, client>::iterator it = clients.begin(); it != clients.end(); ++it)
+      close(it->first);
+    clients.clear();
+    close(epfd);
+    close(wake_fd);
+  }
+
+  // Queue a copy of msg for every client connected. Any thread.
+  void publish(const char *msg, size_t len) {
+    pthread_mutex_lock(&lock);
+    pending.push_back(std::string(msg, len));
+    if (pending.size() > max_queued) {                // the loop is behind; keep the newest
+      pending.erase(pending.begin());
+      __atomic_add_fetch(&ndropped, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&lock);
+
+    wake();
+  }
+
+  int nclients() { return __atomic_load_n(&clients_connected, __ATOMIC_RELAXED); }
+
+  // messages dropped because a client (or the event loop) fell behind.
+  uint64_t dropped() { return __atomic_load_n(&ndropped, __ATOMIC_RELAXED); }
+
+private:
+  broadcaster(const broadcaster &);
+  broadcaster &operator=(const broadcaster &);
+
+  struct client {
+    std::deque<std::string> queue;
+    size_t offset;                                    // sent of queue.front()
+    bool writable_wait;                               // waiting on EPOLLOUT
+
+    client() : offset(0), writable_wait(false) {}
+  };
+
+  static void *thread_main(void *p) {
+    ((broadcaster*) p)->run();
+    return NULL;
+  }
+
+  void wake() {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      perror("broadcast: eventfd");
+  }
+
+  void watch(int fd, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  void rewatch(int fd, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  void run() {
+    struct epoll_event events[64];
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+      int n = epoll_wait(epfd, events, 64, -1);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        perror("broadcast: epoll_wait");
+        break;
+      }
+
+      for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+
+        if (fd == listen_fd) {
+          accept_clients();
+        } else if (fd == wake_fd) {
+          uint64_t count;
+          if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            perror("broadcast: eventfd");
+          fan_out();
+        } else if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+          drop_client(fd);
+        } else {
+          if (events[i].events & EPOLLIN)
+            if (!drain(fd))
+              continue;
+          if (events[i].events & EPOLLOUT)
+            flush(fd);
+        }
+      }
+    }
+  }
+
+  void accept_clients() {
+    while (1) {
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          printf("failed to accept connection (errno=%d)\n", errno);
+        return;
+      }
+
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+      clients[fd] = client();
+      watch(fd, EPOLLIN | EPOLLRDHUP);
+      __atomic_store_n(&clients_connected, (int) clients.size(), __ATOMIC_RELAXED);
+      printf("client %d connected (%d clients)\n", fd, (int) clients.size());
+    }
+  }
+
+  void drop_client(int fd) {
+    if (clients.erase(fd) == 0)
+      return;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    __atomic_store_n(&clients_connected, (int) clients.size(), __ATOMIC_RELAXED);
+    printf("client %d disconnected (%d clients)\n", fd, (int) clients.size());
+  }
+
+  // Read and ignore what the client sent. Returns false if it is gone.
+  bool drain(int fd) {
+    char buf[256];
+    while (1) {
+      ssize_t r = recv(fd, buf, sizeof(buf), 0);
+      if (r > 0)
+        continue;
+      if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return true;
+      if (r < 0 && errno == EINTR)
+        continue;
+      drop_client(fd);
+      return false;
+    }
+  }
+
+  void fan_out() {
+    std::vector<std::string> msgs;
+    pthread_mutex_lock(&lock);
+    msgs.swap(pending);
+    pthread_mutex_unlock(&lock);
+
+    if (msgs.empty())
+      return;
+
+    std::vector<int> fds;
+    for (std::map<int, client>::iterator it = clients.begin(); it != clients.end(); ++it) {
+      client &c = it->second;
+      for (size_t i = 0; i < msgs.size(); i++)
+        c.queue.push_back(msgs[i]);
+
+      // drop the oldest whole messages, never one partly sent.
+      while (c.queue.size() > max_queued && c.queue.size() > 1) {
+        if (c.offset > 0) {
+          std::string partial = c.queue.front();
+          c.queue.pop_front();
+          c.queue.pop_front();
+          c.queue.push_front(partial);
+        } else {
+          c.queue.pop_front();
+        }
+        __atomic_add_fetch(&ndropped, 1, __ATOMIC_RELAXED);
+      }
+      fds.push_back(it->first);
+    }
+
+    for (size_t i = 0; i < fds.size(); i++)
+      flush(fds[i]);
+  }
+
+  // Send as much of the client's queue as the socket takes now.
+  void flush(int fd) {
+    std::map<int, client>::iterator it = clients.find(fd);
+    if (it == clients.end())
+      return;
+    client &c = it->second;
+
+    while (!c.queue.empty()) {
+      const std::string &m = c.queue.front();
+      ssize_t r = send(fd, m.data() + c.offset, m.size() - c.offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        drop_client(fd);
+        return;
+      }
+
+      c.offset += r;
+      if (c.offset == m.size()) {
+        c.queue.pop_front();
+        c.offset = 0;
+      }
+    }
+
+    // only ask to hear about writability while there is something to
+    // write.
+    bool want = !c.queue.empty();
+    if (want != c.writable_wait) {
+      rewatch(fd, EPOLLIN | EPOLLRDHUP | (want ? (uint32_t) EPOLLOUT : 0));
+      c.writable_wait = want;
+    }
+  }
+
+  int listen_fd;
+  size_t max_queued;
+  int epfd, wake_fd;
+
+  pthread_t thread;
+  int running;
+
+  pthread_mutex_t lock;
+  std::vector<std::string> pending;                   // published, not yet fanned out
+
+  std::map<int, client> clients;                      // event loop thread only
+  int clients_connected;
+  uint64_t ndropped;
+};
+
+#endif
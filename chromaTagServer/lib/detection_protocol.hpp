@@ -0,0 +1,270 @@
+/**
+ * The binary message the server sends once per captured frame, and
+ * a decoder for clients. Header only; the server and clients include
+ * the same file.
+ *
+ * Every field is little-endian; floats are IEEE 754 single precision.
+ *
+ * Header (CTAG_HEADER_SIZE bytes):
+ *
+ *   u32 magic           "CTAG"
+ *   u16 version         CTAG_PROTOCOL_VERSION
+ *   u16 header_size     bytes before the first detection
+ *   u32 length          bytes in the whole message, header included
+ *   u32 seq             frame number; a gap means frames were skipped
+ *                       or dropped on the way to this client
+ *   u64 capture_utime   when the frame was captured (utime_now())
+ *   u16 width, height   frame size, which corners are relative to
+ *   u16 ndetections
+ *   u16 detection_size  bytes per detection
+ *
+ * Detection (CTAG_DETECTION_SIZE bytes):
+ *
+ *   u8  family_bits     d*d, e.g. 36 for 36h11
+ *   u8  family_h        minimum hamming distance, e.g. 11
+ *   u16 id
+ *   u8  hamming         bits corrected
+ *   u8  flags           CTAG_POSE_VALID
+ *   u16 reserved
+ *   f32 margin          decision margin
+ *   f32 c[2]            center, pixels
+ *   f32 p[4][2]         corners, pixels, counter clockwise
+ *   f32 R[9]            rotation, row major
+ *   f32 T[3]            translation, in tag size units (cm)
+ *
+ * A later version may grow the header or the detection record;
+ * decoders use header_size and detection_size and ignore what they
+ * don't know, so only an incompatible change bumps the version.
+ */
+
+#ifndef _DETECTION_PROTOCOL_HPP
+#define _DETECTION_PROTOCOL_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#define CTAG_PROTOCOL_MAGIC   0x47415443                      // "CTAG"
+#define CTAG_PROTOCOL_VERSION 1
+#define CTAG_HEADER_SIZE      32
+#define CTAG_DETECTION_SIZE   100
+
+#define CTAG_POSE_VALID       1
+
+struct ctag_detection {
+  uint8_t family_bits, family_h;
+  uint16_t id;
+  uint8_t hamming;
+  uint8_t flags;
+  float margin;
+  float c[2];
+  float p[4][2];
+  float R[9];
+  float T[3];
+};
+
+struct ctag_frame {
+  uint32_t seq;
+  uint64_t capture_utime;
+  uint16_t width, height;
+  std::vector<ctag_detection> detections;
+};
+
+/** Encoding **/
+
+static inline void ctag_put_u8(std::string *out, uint8_t v) {
+  out->push_back((char) v);
+}
+
+static inline void ctag_put_u16(std::string *out, uint16_t v) {
+  char b[2] = { (char) v, (char) (v >> 8) };
+  out->append(b, 2);
+}
+
+static inline void ctag_put_u32(std::string *out, uint32_t v) {
+  char b[4] = { (char) v, (char) (v >> 8), (char) (v >> 16), (char) (v >> 24) };
+  out->append(b, 4);
+}
+
+static inline void ctag_put_u64(std::string *out, uint64_t v) {
+  ctag_put_u32(out, (uint32_t) v);
+  ctag_put_u32(out, (uint32_t) (v >> 32));
+}
+
+static inline void ctag_put_f32(std::string *out, float v) {
+  uint32_t u;
+  memcpy(&u, &v, 4);
+  ctag_put_u32(out, u);
+}
+
+// Appends the message for f to out. At most 65535 detections are sent.
+static inline void ctag_encode(const ctag_frame *f, std::string *out) {
+  size_t n = f->detections.size();
+  if (n > 0xffff)
+    n = 0xffff;
+
+  size_t start = out->size();
+  out->reserve(start + CTAG_HEADER_SIZE + n * CTAG_DETECTION_SIZE);
+
+  ctag_put_u32(out, CTAG_PROTOCOL_MAGIC);
+  ctag_put_u16(out, CTAG_PROTOCOL_VERSION);
+  ctag_put_u16(out, CTAG_HEADER_SIZE);
+  ctag_put_u32(out, CTAG_HEADER_SIZE + n * CTAG_DETECTION_SIZE);
+  ctag_put_u32(out, f->seq);
+  ctag_put_u64(out, f->capture_utime);
+  ctag_put_u16(out, f->width);
+  ctag_put_u16(out, f->height);
+  ctag_put_u16(out, n);
+  ctag_put_u16(out, CTAG_DETECTION_SIZE);
+
+  for (size_t i = 0; i < n; i++) {
+    const ctag_detection *d = &f->detections[i];
+
+    ctag_put_u8(out, d->family_bits);
+    ctag_put_u8(out, d->family_h);
+    ctag_put_u16(out, d->id);
+    ctag_put_u8(out, d->hamming);
+    ctag_put_u8(out, d->flags);
+    ctag_put_u16(out, 0);
+    ctag_put_f32(out, d->margin);
+    for (int j = 0; j < 2; j++)
+      ctag_put_f32(out, d->c[j]);
+    for (int j = 0; j < 4; j++) {
+      ctag_put_f32(out, d->p[j][0]);
+      ctag_put_f32(out, d->p[j][1]);
+    }
+    for (int j = 0; j < 9; j++)
+      ctag_put_f32(out, d->R[j]);
+    for (int j = 0; j < 3; j++)
+      ctag_put_f32(out, d->T[j]);
+  }
+}
+
+/** Decoding **/
+
+static inline uint16_t ctag_get_u16(const uint8_t *b) {
+  return b[0] | (b[1] << 8);
+}
+
+static inline uint32_t ctag_get_u32(const uint8_t *b) {
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+static inline uint64_t ctag_get_u64(const uint8_t *b) {
+  return ctag_get_u32(b) | ((uint64_t) ctag_get_u32(b + 4) << 32);
+}
+
+static inline float ctag_get_f32(const uint8_t *b) {
+  uint32_t u = ctag_get_u32(b);
+  float v;
+  memcpy(&v, &u, 4);
+  return v;
+}
+
+/**
+ * Decodes one message from the start of buf. Returns the number of
+ * bytes it used, 0 if buf doesn't hold a whole message yet, or -1 if
+ * buf doesn't start with a message this decoder understands (wrong
+ * magic or version, or inconsistent sizes); the stream can't be
+ * trusted after that.
+ */
+static inline long ctag_decode(const uint8_t *buf, size_t len, ctag_frame *f) {
+  if (len < 12)
+    return 0;
+
+  if (ctag_get_u32(buf) != CTAG_PROTOCOL_MAGIC || ctag_get_u16(buf + 4) != CTAG_PROTOCOL_VERSION)
+    return -1;
+
+  uint32_t header_size = ctag_get_u16(buf + 6);
+  uint32_t length = ctag_get_u32(buf + 8);
+  if (header_size < CTAG_HEADER_SIZE || length < header_size)
+    return -1;
+  if (len < length)
+    return 0;
+
+  uint32_t n = ctag_get_u16(buf + 28);
+  uint32_t detection_size = ctag_get_u16(buf + 30);
+  if ((n > 0 && detection_size < CTAG_DETECTION_SIZE) ||
+      (uint64_t) header_size + (uint64_t) n * detection_size > length)
+    return -1;
+
+  f->seq = ctag_get_u32(buf + 12);
+  f->capture_utime = ctag_get_u64(buf + 16);
+  f->width = ctag_get_u16(buf + 24);
+  f->height = ctag_get_u16(buf + 26);
+  f->detections.resize(n);
+
+  for (uint32_t i = 0; i < n; i++) {
+    const uint8_t *b = buf + header_size + i * detection_size;
+    ctag_detection *d = &f->detections[i];
+
+    d->family_bits = b[0];
+    d->family_h = b[1];
+    d->id = ctag_get_u16(b + 2);
+    d->hamming = b[4];
+    d->flags = b[5];
+    d->margin = ctag_get_f32(b + 8);
+    b += 12;
+    for (int j = 0; j < 2; j++, b += 4)
+      d->c[j] = ctag_get_f32(b);
+    for (int j = 0; j < 4; j++, b += 8) {
+      d->p[j][0] = ctag_get_f32(b);
+      d->p[j][1] = ctag_get_f32(b + 4);
+    }
+    for (int j = 0; j < 9; j++, b += 4)
+      d->R[j] = ctag_get_f32(b);
+    for (int j = 0; j < 3; j++, b += 4)
+      d->T[j] = ctag_get_f32(b);
+  }
+
+  return length;
+}
+
+/**
+ * Reassembles messages from a byte stream (e.g. whatever recv()
+ * returned): feed() what arrives, then call next() until it returns 0.
+ */
+class ctag_stream {
+public:
+  ctag_stream() : start(0), bad(false) {}
+
+  void feed(const void *data, size_t len) {
+    if (start > 0 && start == buf.size()) {
+      buf.clear();
+      start = 0;
+    }
+    buf.append((const char*) data, len);
+  }
+
+  // 1 and fills f if a whole message was buffered, 0 if more bytes
+  // are needed, -1 if the stream is corrupt (and stays so).
+  int next(ctag_frame *f) {
+    if (bad)
+      return -1;
+
+    long r = ctag_decode((const uint8_t*) buf.data() + start, buf.size() - start, f);
+    if (r < 0) {
+      bad = true;
+      return -1;
+    }
+    if (r == 0) {
+      if (start > 0) {                                    // keep the partial message at the front
+        buf.erase(0, start);
+        start = 0;
+      }
+      return 0;
+    }
+
+    start += r;
+    return 1;
+  }
+
+private:
+  std::string buf;
+  size_t start;                                         // first byte not yet decoded
+  bool bad;
+};
+
+#endif
@@ -0,0 +1,334 @@
+/**
+ * Publishes each frame's detections through a named shared memory
+ * segment, for consumers on the same host.
+ *
+ * The segment is a ring of fixed-size slots, one frame per slot,
+ * written by one producer and read by any number of readers, each
+ * with its own cursor. Every slot is a seqlock: its sequence is odd
+ * while the producer writes it, and a reader that copied a slot
+ * checks the sequence didn't change meanwhile. The producer never
+ * waits for readers; a reader that falls more than a ring behind
+ * skips ahead and counts what it lost.
+ *
+ * Readers either poll (shm_ring_reader::next) or sleep on a futex
+ * (shm_ring_reader::wait). The producer only makes a system call,
+ * to wake them, when some reader is actually asleep.
+ *
+ * The segment is readable and writable by the producer's user and
+ * group only. Readers map it writable (to count themselves in
+ * nwaiters), so the producer never trusts what it reads back from it.
+ *
+ * Linux only; the slots hold native structs, so producer and readers
+ * must be built for the same architecture.
+ */
+
+#ifndef _SHM_RING_HPP
+#define _SHM_RING_HPP
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "detection_protocol.hpp"
+
+#define SHM_RING_MAGIC          0x474e5254                    // "TRNG"
+#define SHM_RING_VERSION        1
+#define SHM_RING_MAX_DETECTIONS 32                            // per frame; the rest are dropped
+#define SHM_RING_MAX_SLOTS      4096
+
+struct shm_ring_frame {
+  uint32_t seq;                                               // as in ctag_frame
+  uint32_t ndetections;
+  uint64_t capture_utime;
+  uint16_t width, height;
+  ctag_detection detections[SHM_RING_MAX_DETECTIONS];
+};
+
+struct shm_ring_slot {
+  uint64_t lock;                                              // 2*pos+1 while writing pos, 2*pos+2 after
+  shm_ring_frame frame;
+};
+
+struct shm_ring_header {
+  uint32_t magic, version;
+  uint32_t nslots, slot_size;
+  uint64_t head;                                              // frames published so far
+  uint32_t futex;                                             // changes on every publish
+  uint32_t nwaiters;                                          // readers asleep on futex
+  uint32_t closed;                                            // the producer has gone
+  uint32_t pad[7];                                            // header fills one cache line
+};
+
+static inline long shm_ring_futex(uint32_t *addr, int op, uint32_t val, const struct timespec *ts) {
+  return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+static inline size_t shm_ring_size(uint32_t nslots) {
+  return sizeof(shm_ring_header) + (size_t) nslots * sizeof(shm_ring_slot);
+}
+
+/**
+ * Creates (or replaces) the segment /dev/shm/<name>; name starts with
+ * '/'. The segment is removed again when the publisher is destroyed.
+ */
+class shm_ring_publisher {
+public:
+  shm_ring_publisher() : hdr(NULL), slots(NULL), size(0), nslots(0), head(0) {}
+  ~shm_ring_publisher() { close(); }
+
+  // Returns false (having said why) if the segment can't be created.
+  // nslots is from 1 to SHM_RING_MAX_SLOTS.
+  bool create(const char *name, int nslots) {
+    if (nslots < 1 || nslots > SHM_RING_MAX_SLOTS) {
+      printf("shm_ring: %s: %d slots; must be 1 to %d\n", name, nslots, SHM_RING_MAX_SLOTS);
+      return false;
+    }
+    this->name = name;
+
+    // readers of a previous run keep their mapping (and see it closed
+    // if that run exited cleanly); new readers get the new segment.
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+    if (fd < 0) {
+      printf("shm_ring: %s: %s\n", name, strerror(errno));
+      return false;
+    }
+    fchmod(fd, 0660);                                     // the group too, whatever the umask
+
+    size = shm_ring_size(nslots);
+    if (ftruncate(fd, size) != 0) {
+      printf("shm_ring: %s: %s\n", name, strerror(errno));
+      ::close(fd);
+      shm_unlink(name);
+      return false;
+    }
+
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      printf("shm_ring: %s: %s\n", name, strerror(errno));
+      shm_unlink(name);
+      return false;
+    }
+
+    hdr = (shm_ring_header*) p;
+    slots = (shm_ring_slot*) (hdr + 1);
+    this->nslots = nslots;
+    head = 0;
+
+    // ftruncate zeroed everything; magic goes last so a reader never
+    // sees a half-initialized header.
+    hdr->version = SHM_RING_VERSION;
+    hdr->nslots = nslots;
+    hdr->slot_size = sizeof(shm_ring_slot);
+    __atomic_store_n(&hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  void publish(const ctag_frame *f) {
+    // readers map the segment writable, so the producer indexes it
+    // only with its own copies of head and nslots.
+    uint64_t pos = head++;
+    shm_ring_slot *s = &slots[pos % nslots];
+
+    __atomic_store_n(&s->lock, 2*pos + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);                // lock is odd before any data changes
+
+    uint32_t n = f->detections.size();
+    if (n > SHM_RING_MAX_DETECTIONS)
+      n = SHM_RING_MAX_DETECTIONS;
+
+    s->frame.seq = f->seq;
+    s->frame.ndetections = n;
+    s->frame.capture_utime = f->capture_utime;
+    s->frame.width = f->width;
+    s->frame.height = f->height;
+    if (n > 0)
+      memcpy(s->frame.detections, &f->detections[0], n * sizeof(ctag_detection));
+
+    __atomic_store_n(&s->lock, 2*pos + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->head, head, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&hdr->futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->nwaiters, __ATOMIC_SEQ_CST) > 0)
+      shm_ring_futex(&hdr->futex, FUTEX_WAKE, INT32_MAX, NULL);
+  }
+
+  void close() {
+    if (hdr == NULL)
+      return;
+
+    __atomic_store_n(&hdr->closed, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&hdr->futex, 1, __ATOMIC_SEQ_CST);
+    shm_ring_futex(&hdr->futex, FUTEX_WAKE, INT32_MAX, NULL);
+
+    munmap(hdr, size);
+    shm_unlink(name.c_str());
+    hdr = NULL;
+  }
+
+private:
+  shm_ring_publisher(const shm_ring_publisher &);
+  shm_ring_publisher &operator=(const shm_ring_publisher &);
+
+  std::string name;
+  shm_ring_header *hdr;
+  shm_ring_slot *slots;
+  size_t size;
+  uint32_t nslots;                                        // ours; the header's copy is for readers
+  uint64_t head;
+};
+
+/**
+ * Follows a segment made by shm_ring_publisher, starting with the
+ * next frame published after open().
+ */
+class shm_ring_reader {
+public:
+  shm_ring_reader() : hdr(NULL), slots(NULL), size(0), nslots(0), pos(0), nlost(0) {}
+  ~shm_ring_reader() { close(); }
+
+  // Returns false (having said why) if there is no usable segment.
+  bool open(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+      printf("shm_ring: %s: %s\n", name, strerror(errno));
+      return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(shm_ring_header)) {
+      printf("shm_ring: %s: not ready\n", name);
+      ::close(fd);
+      return false;
+    }
+
+    // writable only so wait() can count itself in nwaiters.
+    void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      printf("shm_ring: %s: %s\n", name, strerror(errno));
+      return false;
+    }
+
+    hdr = (shm_ring_header*) p;
+    size = st.st_size;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC ||
+        hdr->version != SHM_RING_VERSION || hdr->slot_size != sizeof(shm_ring_slot) ||
+        hdr->nslots == 0 || shm_ring_size(hdr->nslots) > size) {
+      printf("shm_ring: %s: not a version %d ring\n", name, SHM_RING_VERSION);
+      close();
+      return false;
+    }
+
+    slots = (shm_ring_slot*) (hdr + 1);
+    nslots = hdr->nslots;                                 // checked against size just now; keep that one
+    pos = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    return true;
+  }
+
+  void close() {
+    if (hdr != NULL)
+      munmap(hdr, size);
+    hdr = NULL;
+  }
+
+  /**
+   * Copies the next frame into f without blocking. Returns 1 if it
+   * did, 0 if there is nothing new, -1 if the producer has gone.
+   */
+  int next(shm_ring_frame *f) {
+    while (1) {
+      uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+      if (pos == head)
+        return __atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE) ? -1 : 0;
+
+      if (head - pos > nslots) {                          // lapped: skip to the oldest still there
+        nlost += head - pos - nslots;
+        pos = head - nslots;
+      }
+
+      const shm_ring_slot *s = &slots[pos % nslots];
+      uint64_t lock = __atomic_load_n(&s->lock, __ATOMIC_ACQUIRE);
+      if (lock == 2*pos + 2) {
+        copy(&s->frame, f);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);          // the copy is done before lock is checked again
+        if (__atomic_load_n(&s->lock, __ATOMIC_RELAXED) == lock) {
+          pos++;
+          return 1;
+        }
+      }
+
+      // the producer overwrote pos while we read it; the loop
+      // skips ahead.
+      nlost++;
+      pos++;
+    }
+  }
+
+  /**
+   * Like next(), but sleeps up to timeout_ms (forever if negative)
+   * for a frame. Returns 0 on timeout.
+   */
+  int wait(shm_ring_frame *f, int timeout_ms) {
+    struct timespec ts;
+    if (timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    }
+
+    while (1) {
+      uint32_t word = __atomic_load_n(&hdr->futex, __ATOMIC_SEQ_CST);
+
+      int res = next(f);
+      if (res != 0)
+        return res;
+
+      // the producer wakes only if it sees a waiter, and bumps the
+      // word first; so either it sees us, or the word has changed
+      // and FUTEX_WAIT returns at once.
+      __atomic_add_fetch(&hdr->nwaiters, 1, __ATOMIC_SEQ_CST);
+      long r = shm_ring_futex(&hdr->futex, FUTEX_WAIT, word, timeout_ms >= 0 ? &ts : NULL);
+      int err = errno;
+      __atomic_sub_fetch(&hdr->nwaiters, 1, __ATOMIC_SEQ_CST);
+
+      if (r != 0 && err == ETIMEDOUT)
+        return next(f);
+    }
+  }
+
+  // frames skipped because this reader fell behind.
+  uint64_t lost() { return nlost; }
+
+private:
+  shm_ring_reader(const shm_ring_reader &);
+  shm_ring_reader &operator=(const shm_ring_reader &);
+
+  static void copy(const shm_ring_frame *src, shm_ring_frame *dst) {
+    // the header first, then only the detections it says are there;
+    // a torn count is caught by the lock check like anything else.
+    memcpy(dst, src, offsetof(shm_ring_frame, detections));
+    uint32_t n = dst->ndetections;
+    if (n > SHM_RING_MAX_DETECTIONS)
+      n = SHM_RING_MAX_DETECTIONS;
+    memcpy(dst->detections, src->detections, n * sizeof(ctag_detection));
+  }
+
+  shm_ring_header *hdr;
+  shm_ring_slot *slots;
+  size_t size;
+  uint32_t nslots;
+  uint64_t pos;                                           // next frame to read
+  uint64_t nlost;
+};
+
+#endif